@@ -0,0 +1,693 @@
+// bench - Benchmark harness for the image8bit module.
+//
+// Runs a sweep of operations x image sizes x parameters x thread counts,
+// repeating each configuration after some warm-up runs, and reports the
+// median and percentiles of the wall times, as a table on stdout and
+// optionally as CSV and/or JSON files.
+//
+// With T threads, T copies of the operation run at the same time, each
+// on its own images, so the throughput shows how well it scales.
+// Throughput (MPix/s) is based on the pixels processed, as counted by the
+// library's "pixels" instrumentation counter.
+//
+// With --fit, it also checks how the cost grows with the image size: for
+// each operation, it fits a line to log(cost) vs log(pixels) over the
+// sizes, for the time and for each instrumentation counter.  The slope is
+// the empirical exponent of the growth, which must be close to the one
+// expected for that operation (1 for all of them: linear in the number of
+// pixels), or the program fails.  A linear algorithm that becomes
+// quadratic shows up as an exponent near 2.  Counters are exact, so their
+// tolerance can be tight; time also grows faster when the images no longer
+// fit in cache, so its tolerance is looser.
+//
+// With --compare, the times are compared with those of a baseline run
+// (a JSON file written by --json, which includes all the samples).  For
+// each configuration in both, a Mann-Whitney U test tells whether the new
+// times are significantly larger, and the program fails if any such
+// configuration is slower by more than a threshold.
+//
+// With --autotune, it only measures the strategies of blur and locate on
+// this machine and saves the decision table (see ImageAutotune).
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: bench [OPTION VALUE]...\n"
+    "       bench --autotune\n"
+    "  Benchmark image8bit operations.  Lists are comma separated.\n"
+    "  With --autotune, choose the fastest strategies for this machine.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  --ops LIST       Operations to run (default: all):\n"
+    "                   neg thr bri rotate mirror crop paste blend blur locate\n"
+    "  --sizes LIST     Image sizes, in pixels per side (default: 256,1024,2048)\n"
+    "  --radius LIST    Blur radius DX=DY (default: 1,3,7)\n"
+    "  --template LIST  Locate template size (default: 8,32)\n"
+    "  --alpha LIST     Blend alpha (default: 0.5)\n"
+    "  --threads LIST   Number of threads (default: 1)\n"
+    "  --model MODEL    Content of the images (default: noise):\n"
+    "                   noise gradient blocks nearmatch (see ImageSynthetic)\n"
+    "  --reps N         Measured runs per configuration (default: 9)\n"
+    "  --warmup N       Unmeasured runs before those (default: 2)\n"
+    "  --csv FILE       Write results in CSV to FILE\n"
+    "  --json FILE      Write results in JSON to FILE\n"
+    "  --fit TOL[,TTOL] Fit the growth exponent of counters and time with the\n"
+    "                   number of pixels, and fail if it differs from the\n"
+    "                   expected one by more than TOL for counters (e.g. 0.2),\n"
+    "                   or TTOL for time (default: 2*TOL)\n"
+    "                   Default sizes become 128,256,512,1024,2048.\n"
+    "  --compare FILE   Compare times with those of a baseline run in FILE\n"
+    "                   (written by --json), and fail on regressions\n"
+    "  --threshold PCT  Slowdown, in %, that is a regression (default: 5)\n"
+    "  --signif P       Significance level of the test (default: 0.05)\n"
+    "  --strategy OP=S  Force strategy S for OP (default: auto):\n"
+    "                   blur=integral|sliding|small locate=pixels|rows\n"
+    "\n";
+
+// Maximum number of values in a list option
+#define MAXLIST 32
+
+// A list of values given as an option
+struct list {
+  int n;
+  double v[MAXLIST];
+};
+
+// Operations, the parameter swept for each one (if any),
+// and the expected exponent of the growth of their cost with the number of
+// pixels of the image (for a fixed parameter)
+enum { OP_NEG, OP_THR, OP_BRI, OP_ROTATE, OP_MIRROR, OP_CROP, OP_PASTE, OP_BLEND, OP_BLUR, OP_LOCATE };
+
+static const struct {
+  const char* name;
+  const char* param;  // name of the parameter, or NULL
+  double exponent;    // cost is O(pixels^exponent)
+} ops[] = {
+    {"neg", NULL, 1.0},         {"thr", NULL, 1.0},    {"bri", NULL, 1.0},
+    {"rotate", NULL, 1.0},      {"mirror", NULL, 1.0}, {"crop", NULL, 1.0},
+    {"paste", NULL, 1.0},       {"blend", "alpha", 1.0},
+    {"blur", "radius", 1.0},  // independent of the radius
+    {"locate", "template", 1.0},  // (W-w+1)(H-h+1) positions, w*h fixed
+};
+#define NUMOPS (int)(sizeof(ops) / sizeof(ops[0]))
+
+// The work of one thread in one run
+struct job {
+  int op;
+  double param;
+  Image img;   // the image operated on
+  Image img2;  // second image (paste, blend, locate), or NULL
+  int ok;      // did the last run succeed?
+};
+
+// The result of one configuration, kept for fitting
+struct point {
+  int valid;
+  double pixels;                 // pixels in the image
+  double median;                 // median time
+  double count[NUMCOUNTERS];     // counters per run
+};
+
+// Slope of the least squares line through (log pixels, log cost) for the
+// n points pts[], where the cost is the time if c < 0, or counter c.
+// Points that are not valid or with no cost are ignored.
+// Returns NAN if fewer than 2 points remain.
+static double fitSlope(const struct point* pts, int n, int c) {
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  int m = 0;
+  for (int i = 0; i < n; i++) {
+    double y = c < 0 ? pts[i].median : pts[i].count[c];
+    if (!pts[i].valid || y <= 0) continue;
+    double lx = log(pts[i].pixels), ly = log(y);
+    sx += lx;
+    sy += ly;
+    sxx += lx * lx;
+    sxy += lx * ly;
+    m++;
+  }
+  double d = m * sxx - sx * sx;
+  if (m < 2 || d == 0) return NAN;
+  return (m * sxy - sx * sy) / d;
+}
+
+// Print the fits of time and of each counter for points pts[0..n-1],
+// of operation op with parameter param, with the given number of threads.
+// Returns the number of fits that deviate from the expected exponent by
+// more than tol (for counters) or ttol (for time).
+static int reportFit(const struct point* pts, int n, int op, double param, int threads,
+                     double tol, double ttol) {
+  int fails = 0;
+  for (int c = -1; c < NUMCOUNTERS; c++) {
+    if (c >= 0 && InstrName[c] == NULL) continue;
+    double slope = fitSlope(pts, n, c);
+    if (isnan(slope)) continue;  // counter not used by this operation
+    int ok = fabs(slope - ops[op].exponent) <= (c < 0 ? ttol : tol);
+    printf("  %-8s %8g %7d  %-12s %9.3f %9.3f  %s\n", ops[op].name, param, threads,
+           c < 0 ? "time" : InstrName[c], slope, ops[op].exponent, ok ? "ok" : "DEVIATES");
+    fails += !ok;
+  }
+  return fails;
+}
+
+// Parse a comma separated list of numbers.  Returns 0 on failure.
+static int parseList(const char* s, struct list* l) {
+  l->n = 0;
+  while (*s != '\0') {
+    char* end;
+    if (l->n == MAXLIST) return 0;
+    l->v[l->n++] = strtod(s, &end);
+    if (end == s || (*end != ',' && *end != '\0')) return 0;
+    s = *end == ',' ? end + 1 : end;
+  }
+  return l->n > 0;
+}
+
+// Parse a comma separated list of operation names into selected[].
+// Returns 0 on failure.
+static int parseOps(const char* s, int selected[NUMOPS]) {
+  for (int i = 0; i < NUMOPS; i++) selected[i] = 0;
+  while (*s != '\0') {
+    size_t len = strcspn(s, ",");
+    int i = 0;
+    while (i < NUMOPS && (strlen(ops[i].name) != len || strncmp(s, ops[i].name, len) != 0)) i++;
+    if (i == NUMOPS) return 0;
+    selected[i] = 1;
+    s += s[len] == ',' ? len + 1 : len;
+  }
+  return 1;
+}
+
+// Content model of the synthetic images
+static ImageSynthModel model = SYNTH_NOISE;
+static const char* modelNames[] = {"noise", "gradient", "blocks", "nearmatch"};
+
+// Prepare the images of job j for a size x size image.
+// Returns 0 on failure.
+static int setupJob(struct job* j, int op, double param, int size, unsigned seed) {
+  j->op = op;
+  j->param = param;
+  j->img2 = NULL;
+  if ((j->img = ImageSynthetic(size, size, model, seed)) == NULL) return 0;
+  if (op == OP_PASTE || op == OP_BLEND) {
+    j->img2 = ImageSynthetic(size / 2, size / 2, model, seed + 1);
+  } else if (op == OP_LOCATE) {
+    // The template is embedded in the bottom right corner:
+    // the whole image is searched
+    int t = (int)param;
+    j->img2 = ImageSyntheticTemplate(t, t, model, seed + 1);
+    if (j->img2 != NULL) ImagePaste(j->img, size - t, size - t, j->img2);
+  } else {
+    return 1;
+  }
+  return j->img2 != NULL;
+}
+
+static void teardownJob(struct job* j) {
+  ImageDestroy(&j->img);
+  ImageDestroy(&j->img2);
+}
+
+// Run the operation of job j once.
+static void* runJob(void* arg) {
+  struct job* j = arg;
+  InstrThreadInit();  // count this thread's operations in InstrSnapshot
+  Image img = j->img;
+  int size = ImageWidth(img);
+  Image result = NULL;
+  int x, y;
+  j->ok = 1;
+  switch (j->op) {
+    case OP_NEG:
+      ImageNegative(img);
+      break;
+    case OP_THR:
+      ImageThreshold(img, 128);
+      break;
+    case OP_BRI:
+      ImageBrighten(img, 1.0);  // the image does not change between runs
+      break;
+    case OP_ROTATE:
+      j->ok = (result = ImageRotate(img)) != NULL;
+      break;
+    case OP_MIRROR:
+      j->ok = (result = ImageMirror(img)) != NULL;
+      break;
+    case OP_CROP:
+      j->ok = (result = ImageCrop(img, size / 4, size / 4, size / 2, size / 2)) != NULL;
+      break;
+    case OP_PASTE:
+      ImagePaste(img, size / 4, size / 4, j->img2);
+      break;
+    case OP_BLEND:
+      ImageBlend(img, size / 4, size / 4, j->img2, j->param);
+      break;
+    case OP_BLUR:
+      ImageBlur(img, (int)j->param, (int)j->param);
+      break;
+    case OP_LOCATE:
+      j->ok = ImageLocateSubImage(img, &x, &y, j->img2);
+      break;
+  }
+  ImageDestroy(&result);
+  return NULL;
+}
+
+// Run all jobs at the same time, one per thread.
+// Returns the wall time taken, or -1 on failure.
+static double runJobs(struct job* jobs, int threads) {
+  double time = wall_time();
+  if (threads == 1) {
+    runJob(&jobs[0]);
+  } else {
+    pthread_t tid[threads];
+    int started = 0;
+    while (started < threads && pthread_create(&tid[started], NULL, runJob, &jobs[started]) == 0)
+      started++;
+    for (int t = 0; t < started; t++) pthread_join(tid[t], NULL);
+    if (started < threads) return -1.0;
+  }
+  time = wall_time() - time;
+  for (int t = 0; t < threads; t++) {
+    if (!jobs[t].ok) return -1.0;
+  }
+  return time;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Percentile p of the n sorted values v (nearest rank).
+static double percentile(const double* v, int n, double p) {
+  int k = (int)ceil(p / 100.0 * n) - 1;
+  return v[k < 0 ? 0 : k];
+}
+
+// The samples of one configuration, kept for comparison
+struct result {
+  int op;
+  double value;
+  int size, threads;
+  int n;
+  double* samples;  // n sorted times
+};
+
+// A growing array of results
+struct results {
+  int n, max;
+  struct result* r;
+};
+
+// Append a result with a copy of the n sorted samples v.
+static void addResult(struct results* rs, int op, double value, int size, int threads,
+                      const double* v, int n) {
+  if (rs->n == rs->max) {
+    rs->max = rs->max > 0 ? 2 * rs->max : 64;
+    rs->r = realloc(rs->r, (size_t)rs->max * sizeof(struct result));
+    if (rs->r == NULL) error(2, errno, "Allocating results");
+  }
+  struct result* r = &rs->r[rs->n++];
+  *r = (struct result){op, value, size, threads, n, malloc((size_t)n * sizeof(double))};
+  if (r->samples == NULL) error(2, errno, "Allocating results");
+  memcpy(r->samples, v, (size_t)n * sizeof(double));
+}
+
+static void freeResults(struct results* rs) {
+  for (int i = 0; i < rs->n; i++) free(rs->r[i].samples);
+  free(rs->r);
+}
+
+// Find the number after "key": in line.  Returns NULL if not found, or
+// a pointer to the number.
+static const char* jsonField(const char* line, const char* key) {
+  char pattern[32];
+  snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+  const char* p = strstr(line, pattern);
+  return p != NULL ? p + strlen(pattern) : NULL;
+}
+
+// Load the results in a JSON file written by --json (one result per line).
+// Results of unknown operations or without samples are ignored.
+// Returns 0 on failure.
+static int loadResults(const char* file, struct results* rs) {
+  FILE* f = fopen(file, "r");
+  if (f == NULL) return 0;
+  char* line = NULL;
+  size_t cap = 0;
+  double* v = NULL;
+  while (getline(&line, &cap, f) != -1) {
+    const char *name = jsonField(line, "op"), *value = jsonField(line, "value"),
+               *size = jsonField(line, "size"), *threads = jsonField(line, "threads"),
+               *samples = jsonField(line, "samples");
+    if (name == NULL || value == NULL || size == NULL || threads == NULL || samples == NULL)
+      continue;
+    int op = 0;
+    while (op < NUMOPS && (strncmp(name + 1, ops[op].name, strlen(ops[op].name)) != 0 ||
+                           name[1 + strlen(ops[op].name)] != '"'))
+      op++;
+    if (op == NUMOPS || *samples != '[') continue;
+    // Parse the samples
+    int n = 0;
+    const char* p = samples + 1;
+    char* end;
+    v = realloc(v, (strlen(p) / 2 + 1) * sizeof(double));  // enough for all numbers
+    if (v == NULL) error(2, errno, "Allocating results");
+    while ((v[n] = strtod(p, &end)), end != p) {
+      n++;
+      p = *end == ',' ? end + 1 : end;
+    }
+    if (n == 0) continue;
+    qsort(v, n, sizeof(double), compareDoubles);
+    addResult(rs, op, strtod(value, NULL), atoi(size), atoi(threads), v, n);
+  }
+  free(v);
+  free(line);
+  fclose(f);
+  return 1;
+}
+
+// Mann-Whitney U test, with the normal approximation (corrected for ties).
+// Given the sorted samples a[0..n-1] and b[0..m-1], returns the one-sided
+// p-value of the hypothesis that values in b tend to be larger than in a.
+static double mannWhitney(const double* a, int n, const double* b, int m) {
+  // Merge the samples, summing the ranks of b (ties get the average rank)
+  double rankSum = 0.0, ties = 0.0;
+  int i = 0, j = 0;
+  while (i < n || j < m) {
+    double x = j == m || (i < n && a[i] < b[j]) ? a[i] : b[j];
+    int ka = 0, kb = 0;
+    while (i + ka < n && a[i + ka] == x) ka++;
+    while (j + kb < m && b[j + kb] == x) kb++;
+    double t = ka + kb;
+    rankSum += kb * (i + j + (t + 1) / 2);  // ranks i+j+1 .. i+j+t
+    ties += t * t * t - t;
+    i += ka;
+    j += kb;
+  }
+  double N = n + m;
+  double u = rankSum - m * (m + 1) / 2.0;
+  double mean = n * (double)m / 2;
+  double var = n * (double)m / 12 * ((N + 1) - ties / (N * (N - 1)));
+  if (var <= 0) return 1.0;  // all values equal
+  double z = (u - mean - 0.5) / sqrt(var);  // with continuity correction
+  return 0.5 * erfc(z / sqrt(2.0));
+}
+
+// Compare the results in cur with those of the same configuration in base,
+// and print a table with the speedup of each one.
+// Returns the number of regressions: configurations significantly slower
+// (at level signif) by more than threshold percent.
+static int compareResults(const struct results* base, const struct results* cur,
+                          double threshold, double signif) {
+  int regressions = 0;
+  printf("# %-8s %8s %6s %7s %12s %12s %8s %9s  %s\n", "compare", "param", "size", "threads",
+         "base(s)", "new(s)", "speedup", "p", "verdict");
+  for (int c = 0; c < cur->n; c++) {
+    const struct result* r = &cur->r[c];
+    const struct result* b = NULL;
+    for (int i = 0; i < base->n && b == NULL; i++) {
+      const struct result* x = &base->r[i];
+      if (x->op == r->op && x->value == r->value && x->size == r->size && x->threads == r->threads)
+        b = x;
+    }
+    double now = percentile(r->samples, r->n, 50);
+    if (b == NULL) {
+      printf("  %-8s %8g %6d %7d %12s %12.6f %8s %9s  %s\n", ops[r->op].name, r->value, r->size,
+             r->threads, "-", now, "-", "-", "new");
+      continue;
+    }
+    double before = percentile(b->samples, b->n, 50);
+    double speedup = now > 0 ? before / now : 1.0;
+    const char* verdict = "same";
+    double p = mannWhitney(b->samples, b->n, r->samples, r->n);  // slower?
+    if (p < signif && now > before * (1 + threshold / 100)) {
+      verdict = "SLOWER";
+      regressions++;
+    } else {
+      double q = mannWhitney(r->samples, r->n, b->samples, b->n);  // faster?
+      if (q < signif && before > now * (1 + threshold / 100)) {
+        verdict = "faster";
+        p = q;
+      }
+    }
+    printf("  %-8s %8g %6d %7d %12.6f %12.6f %8.3f %9.2g  %s\n", ops[r->op].name, r->value,
+           r->size, r->threads, before, now, speedup, p, verdict);
+  }
+  return regressions;
+}
+
+// Parse "OP=STRATEGY" and force that strategy.  Returns 0 if invalid.
+static int parseStrategy(const char* val) {
+  const char* eq = strchr(val, '=');
+  if (eq == NULL) return 0;
+  ImageTuneOp op;
+  if (strncmp(val, "blur=", 5) == 0) {
+    op = TUNE_BLUR;
+  } else if (strncmp(val, "locate=", 7) == 0) {
+    op = TUNE_LOCATE;
+  } else {
+    return 0;
+  }
+  int last = op == TUNE_BLUR ? BLUR_SMALL : LOCATE_ROWS;
+  for (int s = STRATEGY_AUTO; s <= last; s++) {
+    if (strcmp(eq + 1, ImageStrategyName(op, s)) == 0) {
+      ImageForceStrategy(op, s);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+
+  int selected[NUMOPS];
+  struct list sizes = {3, {256, 1024, 2048}};
+  struct list radius = {3, {1, 3, 7}};
+  struct list templ = {2, {8, 32}};
+  struct list alpha = {1, {0.5}};
+  struct list threads = {1, {1}};
+  int reps = 9, warmup = 2;
+  const char* csvFile = NULL;
+  const char* jsonFile = NULL;
+  double tol = -1.0;   // fit tolerance for counters (< 0 if not fitting)
+  double ttol = -1.0;  // and for time
+  int sizesGiven = 0;
+  const char* baseFile = NULL;
+  double threshold = 5.0, signif = 0.05;
+  parseOps("neg,thr,bri,rotate,mirror,crop,paste,blend,blur,locate", selected);
+
+  if (argc == 2 && strcmp(argv[1], "--autotune") == 0) {
+    ImageInit();
+    if (!ImageAutotune(1)) error(2, errno, "Saving decision table: %s", ImageErrMsg());
+    return 0;
+  }
+
+  for (int k = 1; k < argc; k += 2) {
+    const char* opt = argv[k];
+    const char* val = k + 1 < argc ? argv[k + 1] : NULL;
+    int ok = val != NULL;
+    if (!ok) {
+    } else if (strcmp(opt, "--ops") == 0) {
+      ok = parseOps(val, selected);
+    } else if (strcmp(opt, "--sizes") == 0) {
+      ok = parseList(val, &sizes);
+      sizesGiven = 1;
+    } else if (strcmp(opt, "--radius") == 0) {
+      ok = parseList(val, &radius);
+    } else if (strcmp(opt, "--template") == 0) {
+      ok = parseList(val, &templ);
+    } else if (strcmp(opt, "--alpha") == 0) {
+      ok = parseList(val, &alpha);
+    } else if (strcmp(opt, "--threads") == 0) {
+      ok = parseList(val, &threads);
+    } else if (strcmp(opt, "--model") == 0) {
+      int m = 0;
+      while (m < 4 && strcmp(val, modelNames[m]) != 0) m++;
+      model = (ImageSynthModel)m;
+      ok = m < 4;
+    } else if (strcmp(opt, "--reps") == 0) {
+      ok = sscanf(val, "%d", &reps) == 1 && reps > 0;
+    } else if (strcmp(opt, "--warmup") == 0) {
+      ok = sscanf(val, "%d", &warmup) == 1 && warmup >= 0;
+    } else if (strcmp(opt, "--csv") == 0) {
+      csvFile = val;
+    } else if (strcmp(opt, "--json") == 0) {
+      jsonFile = val;
+    } else if (strcmp(opt, "--fit") == 0) {
+      int k = sscanf(val, "%lf,%lf", &tol, &ttol);
+      if (k == 1) ttol = 2 * tol;
+      ok = k >= 1 && tol >= 0 && ttol >= 0;
+    } else if (strcmp(opt, "--compare") == 0) {
+      baseFile = val;
+    } else if (strcmp(opt, "--threshold") == 0) {
+      ok = sscanf(val, "%lf", &threshold) == 1 && threshold >= 0;
+    } else if (strcmp(opt, "--signif") == 0) {
+      ok = sscanf(val, "%lf", &signif) == 1 && signif > 0 && signif < 1;
+    } else if (strcmp(opt, "--strategy") == 0) {
+      ok = parseStrategy(val);
+    } else {
+      ok = 0;
+    }
+    if (!ok) error(1, 0, "Invalid option %s\n%s", opt, USAGE);
+  }
+  for (int t = 0; t < threads.n; t++) {
+    if (threads.v[t] < 1) error(1, 0, "Invalid number of threads");
+  }
+  if (tol >= 0 && !sizesGiven) sizes = (struct list){5, {128, 256, 512, 1024, 2048}};
+  if (tol >= 0 && sizes.n < 3) error(1, 0, "Fitting needs at least 3 sizes");
+
+  // Load the baseline first, so that a bad file fails before running
+  struct results base = {0, 0, NULL}, cur = {0, 0, NULL};
+  if (baseFile != NULL && !loadResults(baseFile, &base)) error(2, errno, "%s", baseFile);
+
+  ImageInit();
+
+  FILE* csv = NULL;
+  FILE* json = NULL;
+  if (csvFile != NULL && (csv = fopen(csvFile, "w")) == NULL) error(2, errno, "%s", csvFile);
+  if (jsonFile != NULL && (json = fopen(jsonFile, "w")) == NULL) error(2, errno, "%s", jsonFile);
+  if (csv != NULL)
+    fprintf(csv, "op,param,value,size,threads,reps,min,p10,median,p90,max,mpix_s\n");
+  if (json != NULL) fprintf(json, "{\"results\": [");
+  printf("# %-8s %8s %6s %7s %12s %12s %12s %10s\n", "op", "param", "size", "threads", "median(s)",
+         "p10(s)", "p90(s)", "MPix/s");
+
+  double* times = malloc((size_t)(warmup + reps) * sizeof(double));
+  if (times == NULL) error(2, errno, "Allocating times");
+  int results = 0;
+  int fails = 0;
+  for (int op = 0; op < NUMOPS; op++) {
+    if (!selected[op]) continue;
+    // Parameter values for this operation
+    struct list none = {1, {0}};
+    struct list* params = &none;
+    if (op == OP_BLEND) params = &alpha;
+    if (op == OP_BLUR) params = &radius;
+    if (op == OP_LOCATE) params = &templ;
+    // Results for fitting, indexed by [param][threads][size]
+    struct point* points = NULL;
+    if (tol >= 0) {
+      points = calloc((size_t)params->n * threads.n * sizes.n, sizeof(struct point));
+      if (points == NULL) error(2, errno, "Allocating results");
+    }
+
+    for (int s = 0; s < sizes.n; s++) {
+      int size = (int)sizes.v[s];
+      for (int p = 0; p < params->n; p++) {
+        double param = params->v[p];
+        // Skip parameters that do not fit the image
+        if (op == OP_BLUR && (param < 0 || 2 * param + 1 > size)) continue;
+        if (op == OP_LOCATE && (param < 1 || param > size)) continue;
+        if (size < 2) continue;
+
+        for (int t = 0; t < threads.n; t++) {
+          int nthreads = (int)threads.v[t];
+          struct job jobs[nthreads];
+          int ready = 0;
+          while (ready < nthreads && setupJob(&jobs[ready], op, param, size, 1000 * s + ready))
+            ready++;
+          int n = 0;
+          unsigned long before[NUMCOUNTERS], after[NUMCOUNTERS];
+          if (ready == nthreads) {
+            for (int r = 0; r < warmup + reps; r++) {
+              if (r == warmup) InstrSnapshot(before);
+              double time = runJobs(jobs, nthreads);
+              if (time < 0) break;
+              if (r >= warmup) times[n++] = time;
+            }
+          }
+          InstrSnapshot(after);
+          for (int j = 0; j < ready; j++) teardownJob(&jobs[j]);
+          if (n < reps) error(3, errno, "%s %dx%d: %s", ops[op].name, size, size, ImageErrMsg());
+
+          qsort(times, n, sizeof(double), compareDoubles);
+          double median = percentile(times, n, 50);
+          double p10 = percentile(times, n, 10);
+          double p90 = percentile(times, n, 90);
+          // Pixels processed per run, as counted by the library
+          // (or the image size, if it is built without counters)
+#if INSTR_LEVEL >= 1
+          double pixels = (double)(after[InstrPixels] - before[InstrPixels]) / n;
+#else
+          double pixels = (double)nthreads * size * size;
+#endif
+          double mpix = median > 0 ? pixels / median / 1e6 : 0.0;
+          const char* pname = ops[op].param != NULL ? ops[op].param : "";
+          printf("  %-8s %8g %6d %7d %12.6f %12.6f %12.6f %10.1f\n", ops[op].name, param, size,
+                 nthreads, median, p10, p90, mpix);
+          fflush(stdout);
+          if (csv != NULL)
+            fprintf(csv, "%s,%s,%g,%d,%d,%d,%.9f,%.9f,%.9f,%.9f,%.9f,%.3f\n", ops[op].name, pname,
+                    param, size, nthreads, n, times[0], p10, median, p90, times[n - 1], mpix);
+          if (json != NULL)
+            fprintf(json,
+                    "%s\n  {\"op\": \"%s\", \"param\": \"%s\", \"value\": %g, \"size\": %d, "
+                    "\"threads\": %d, \"reps\": %d, \"min\": %.9f, \"p10\": %.9f, "
+                    "\"median\": %.9f, \"p90\": %.9f, \"max\": %.9f, \"mpix_s\": %.3f, "
+                    "\"samples\": [",
+                    results > 0 ? "," : "", ops[op].name, pname, param, size, nthreads, n,
+                    times[0], p10, median, p90, times[n - 1], mpix);
+          if (json != NULL) {
+            for (int i = 0; i < n; i++) fprintf(json, "%s%.9f", i > 0 ? ", " : "", times[i]);
+            fprintf(json, "]}");
+          }
+          if (baseFile != NULL) addResult(&cur, op, param, size, nthreads, times, n);
+          results++;
+          if (points != NULL) {
+            struct point* pt = &points[(p * threads.n + t) * sizes.n + s];
+            pt->valid = 1;
+            pt->pixels = (double)size * size;
+            pt->median = median;
+            for (int c = 0; c < NUMCOUNTERS; c++)
+              pt->count[c] = (double)(after[c] - before[c]) / n;
+          }
+        }
+      }
+    }
+    if (points != NULL) {
+      printf("# %-8s %8s %7s  %-12s %9s %9s  (tolerance %g, time %g)\n", "fit", "param",
+             "threads", "of", "exponent", "expected", tol, ttol);
+      for (int p = 0; p < params->n; p++) {
+        for (int t = 0; t < threads.n; t++)
+          fails += reportFit(&points[(p * threads.n + t) * sizes.n], sizes.n, op, params->v[p],
+                             (int)threads.v[t], tol, ttol);
+      }
+      fflush(stdout);
+      free(points);
+    }
+  }
+  free(times);
+
+  if (json != NULL) {
+    fprintf(json, "\n]}\n");
+    fclose(json);
+  }
+  if (csv != NULL) fclose(csv);
+  ImagePoolRelease();
+  int regressions = 0;
+  if (baseFile != NULL) {
+    regressions = compareResults(&base, &cur, threshold, signif);
+    fflush(stdout);
+  }
+  freeResults(&base);
+  freeResults(&cur);
+  if (regressions > 0)
+    error(5, 0, "%d regressions (slower by more than %g%%, p < %g)", regressions, threshold,
+          signif);
+  if (fails > 0) error(4, 0, "%d fits deviate from the expected exponent", fails);
+  return 0;
+}
@@ -18,14 +18,23 @@
 //
 
 #include "image8bit.h"
+#include "image8bit_fast.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "instrumentation.h"
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
 // The data structure
 //
 // An image is stored in a structure containing 3 fields:
@@ -45,14 +54,8 @@
 // Maximum value you can store in a pixel (maximum maxval accepted)
 const uint8 PixMax = 255;
 
-// Internal structure for storing 8-bit graymap images
-struct image
-{
-  int width;
-  int height;
-  int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
-  uint8 *pixel; // pixel data (a raster scan)
-};
+// The internal structure for storing 8-bit graymap images, struct image,
+// is defined in image8bit_fast.h, which also has inlinable accessors.
 
 // This module follows "design-by-contract" principles.
 // Read `Design-by-Contract.md` for more details.
@@ -72,12 +75,15 @@ struct image
 // this purpose.
 //
 // Additional information:  man 3 errno;  man 3 error;
+//
+// Like errno, these variables are per thread, so that threads may call
+// functions of this module concurrently without mixing their errors.
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static _Thread_local int errsave = 0;
 
 // Error cause
-static char *errCause;
+static _Thread_local char *errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -141,66 +147,327 @@ static int check(int condition, const char *failmsg)
 }
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply request calibration of instrumentation
+/// (done on first InstrPrint) and set names of counters.
 void ImageInit(void)
 { ///
-  InstrCalibrate();
+  InstrCalibrateLazy();
   InstrName[0] = "pixmem"; // InstrCount[0] will count pixel array acesses
   InstrName[1] = "iterations";
+  InstrName[2] = "pixels"; // InstrCount[2] will count pixels processed
+  InstrName[3] = "bytes";  // InstrCount[3] will count bytes read and written
+  InstrPixels = 2;         // show throughput in InstrPrint
+  InstrBytes = 3;
   // Name other counters here...
 }
 
-// Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
-#define ITERATIONS InstrCount[1]
+// Macros to simplify accessing instrumentation counters
+// (indices of InstrCount, to use with INSTR_OP and INSTR_BULK):
+#define PIXMEM 0
+#define ITERATIONS 1
+#define PIXELS 2
+#define BYTES 3
 // Add more macros here...
 
-// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+// Count an operation on n pixels that moves the given number of bytes
+// (pixels and auxiliary data, read and written).
+// Done once per call, for throughput figures (MPix/s, GB/s) in InstrPrint.
+// ImageGetPixel/ImageSetPixel are counted by PIXMEM only.
+#define COUNTPIXELS(n, bytes) (INSTR_BULK(PIXELS, (n)), INSTR_BULK(BYTES, (bytes)))
+
+// TIP: Search for PIXMEM or INSTR_ to see where counters are incremented!
 
 /// Image management functions
 
-/// Create a new black image.
-///   width, height : the dimensions of the new image.
-///   maxval: the maximum gray level (corresponding to white).
-/// Requires: width and height must be non-negative, maxval > 0.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval)
+// Pixel buffer pool
+//
+// Geometric operations create a new image on every call, so a loop that
+// processes many frames of the same size keeps allocating and releasing
+// identical pixel buffers, paying for malloc and for fresh page faults on
+// every iteration.  To avoid that, ImageDestroy does not free pixel buffers
+// immediately: it keeps a few of them in a pool, organized in size classes,
+// and the next ImageCreate of a compatible size reuses one of them.
+//
+// Size classes are powers of two, each divided in 4 steps
+// (4/4, 5/4, 6/4 and 7/4 of the power), so that a buffer never wastes more
+// than 25% of its size.  Buffers smaller than the first class are cheap to
+// allocate and go directly to malloc/free.
+// Large buffers may be backed by transparent huge pages (Linux only),
+// which reduces TLB misses and the number of page faults.
+// The pool is protected by a mutex, so images may be created and destroyed
+// by several threads.
+// Images created with a context (ImageContext) use the pool of their
+// context, and the other images use a pool shared by the whole program.
+
+#define POOLMINSHIFT 12 // first size class: 4 KiB
+#define POOLCLASSES (4 * (48 - POOLMINSHIFT))
+#define POOLDEPTH 4 // buffers kept per size class
+#define HUGEPAGESIZE ((size_t)2 << 20)
+
+struct pixelPool
+{
+  struct
+  {
+    int count;
+    void *buf[POOLDEPTH];
+  } bucket[POOLCLASSES];
+  pthread_mutex_t lock;
+  unsigned long hits; // statistics
+  unsigned long misses;
+  int hugePages; // advise huge pages for large buffers?
+};
+
+// The pool of the images without a context
+static struct pixelPool sharedPool = {.lock = PTHREAD_MUTEX_INITIALIZER, .hugePages = 1};
+
+// A context: the state of an independent job
+struct imageContext
+{
+  struct pixelPool pool;
+  int images; // images of the context not yet destroyed (under pool.lock)
+};
+
+// Get the pool of the images of context ctx (NULL for no context).
+static struct pixelPool *poolOf(ImageContext ctx)
+{
+  return ctx != NULL ? &ctx->pool : &sharedPool;
+}
+
+// Find the size class for a buffer of n bytes.
+// Returns -1 if the buffer is too small to be pooled.
+// On return, *size is set to the number of bytes to allocate.
+static int poolClass(size_t n, size_t *size)
+{
+  *size = n;
+  if (n < ((size_t)1 << POOLMINSHIFT))
+    return -1;
+  for (int c = 0; c < POOLCLASSES; c++)
+  {
+    size_t csize = (size_t)(4 + c % 4) << (POOLMINSHIFT + c / 4 - 2);
+    if (csize >= n)
+    {
+      *size = csize;
+      return c;
+    }
+  }
+  return -1;
+}
+
+// Get a pixel buffer with at least n bytes (contents undefined) from pool.
+// Returns NULL on failure (errno is set by the allocator).
+static uint8 *poolAlloc(struct pixelPool *pool, size_t n)
+{
+  size_t size;
+  int c = poolClass(n, &size);
+  pthread_mutex_lock(&pool->lock);
+  if (c >= 0 && pool->bucket[c].count > 0)
+  {
+    pool->hits++;
+    uint8 *buf = pool->bucket[c].buf[--pool->bucket[c].count];
+    pthread_mutex_unlock(&pool->lock);
+    return buf;
+  }
+  pool->misses++;
+  int hugePages = pool->hugePages;
+  pthread_mutex_unlock(&pool->lock);
+  if (size == 0)
+    size = 1; // malloc(0) may return NULL
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (hugePages && size >= HUGEPAGESIZE)
+  {
+    void *buf;
+    int err = posix_memalign(&buf, HUGEPAGESIZE, size);
+    if (err != 0)
+    {
+      errno = err;
+      return NULL;
+    }
+    madvise(buf, size, MADV_HUGEPAGE); // just a hint, ignore failures
+    return buf;
+  }
+#else
+  (void)hugePages;
+#endif
+  return malloc(size);
+}
+
+// Return a pixel buffer of n bytes to pool (or free it).
+static void poolFree(struct pixelPool *pool, uint8 *buf, size_t n)
+{
+  size_t size;
+  int c = poolClass(n, &size);
+  pthread_mutex_lock(&pool->lock);
+  if (c >= 0 && pool->bucket[c].count < POOLDEPTH)
+  {
+    pool->bucket[c].buf[pool->bucket[c].count++] = buf;
+    pthread_mutex_unlock(&pool->lock);
+    return;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  free(buf);
+}
+
+// Free all the buffers kept in pool.
+static void poolRelease(struct pixelPool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  for (int c = 0; c < POOLCLASSES; c++)
+  {
+    while (pool->bucket[c].count > 0)
+      free(pool->bucket[c].buf[--pool->bucket[c].count]);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/// Pool statistics.
+/// Sets (*hits) to the number of pixel buffers reused from the pool and
+/// (*misses) to the number of buffers that had to be allocated.
+void ImagePoolStats(unsigned long *hits, unsigned long *misses)
+{ ///
+  assert(hits != NULL);
+  assert(misses != NULL);
+  ImageContextPoolStats(NULL, hits, misses);
+}
+
+/// Enable (nonzero) or disable (0) huge page advice for large buffers.
+void ImagePoolHugePages(int enable)
+{ ///
+  pthread_mutex_lock(&sharedPool.lock);
+  sharedPool.hugePages = enable;
+  pthread_mutex_unlock(&sharedPool.lock);
+}
+
+/// Release all pixel buffers kept in the pool.
+void ImagePoolRelease(void)
+{ ///
+  errsave = errno;
+  poolRelease(&sharedPool);
+  errno = errsave;
+}
+
+/// Contexts
+
+/// Create a new context.
+ImageContext ImageContextCreate(void)
+{ ///
+  ImageContext ctx = calloc(1, sizeof(struct imageContext));
+  if (!check(ctx != NULL, "Allocating context"))
+  {
+    return NULL;
+  }
+  pthread_mutex_init(&ctx->pool.lock, NULL);
+  ctx->pool.hugePages = 1;
+  return ctx;
+}
+
+/// Destroy the context pointed to by (*ctxp).
+void ImageContextDestroy(ImageContext *ctxp)
 { ///
+  assert(ctxp != NULL);
+  if (*ctxp == NULL)
+    return;
+  assert((*ctxp)->images == 0);
+  errsave = errno;
+  poolRelease(&(*ctxp)->pool);
+  pthread_mutex_destroy(&(*ctxp)->pool.lock);
+  free(*ctxp);
+  *ctxp = NULL;
+  errno = errsave;
+}
+
+/// Get the pool statistics of context ctx.
+void ImageContextPoolStats(ImageContext ctx, unsigned long *hits, unsigned long *misses)
+{ ///
+  assert(hits != NULL);
+  assert(misses != NULL);
+  struct pixelPool *pool = poolOf(ctx);
+  pthread_mutex_lock(&pool->lock);
+  *hits = pool->hits;
+  *misses = pool->misses;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/// Get the context of img.
+ImageContext ImageGetContext(Image img)
+{ ///
+  assert(img != NULL);
+  return img->ctx;
+}
+
+// Create a new image with undefined pixel contents.
+// This is meant for internal operations that write every pixel of
+// the new image, so clearing it first would be a wasted pass.
+// The image belongs to context ctx (may be NULL).
+// Same requirements and failure behavior as ImageCreate.
+static Image imageCreateRaw(ImageContext ctx, int width, int height, uint8 maxval)
+{
   assert(width >= 0);
   assert(height >= 0);
   assert(0 < maxval && maxval <= PixMax);
-  // Insert your code here!
   Image img = malloc(sizeof(struct image));
-  if (img == NULL)
+  if (!check(img != NULL, "Allocating image"))
   {
-    errsave = errno;
-    errno = errsave;
     return NULL;
   }
 
   img->width = width;
   img->height = height;
   img->maxval = maxval;
-  img->pixel = malloc(width * height * sizeof(uint8));
+  img->ctx = ctx;
+  img->pixel = poolAlloc(poolOf(ctx), (size_t)width * height * sizeof(uint8));
 
-  if (img->pixel == NULL)
+  if (!check(img->pixel != NULL, "Allocating pixels"))
   {
     errsave = errno;
-    errno = errsave;
     free(img);
+    errno = errsave;
     return NULL;
   }
-
-  for (int i = 0; i < width*height; i++){
-    img->pixel[i] = 0;
+  if (ctx != NULL)
+  {
+    pthread_mutex_lock(&ctx->pool.lock);
+    ctx->images++;
+    pthread_mutex_unlock(&ctx->pool.lock);
   }
+  return img;
+}
+
+/// Create a new black image.
+///   width, height : the dimensions of the new image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreate(int width, int height, uint8 maxval)
+{ ///
+  return ImageCreateCtx(NULL, width, height, maxval);
+}
 
+/// Create a new black image in context ctx.
+Image ImageCreateCtx(ImageContext ctx, int width, int height, uint8 maxval)
+{ ///
+  Image img = imageCreateRaw(ctx, width, height, maxval);
+  if (img != NULL)
+  {
+    memset(img->pixel, 0, (size_t)width * height);
+  }
   return img;
 }
 
+/// Create a new image with undefined pixel levels.
+Image ImageCreateUninit(int width, int height, uint8 maxval)
+{ ///
+  return imageCreateRaw(NULL, width, height, maxval);
+}
+
+/// Create a new image with undefined pixel levels in context ctx.
+Image ImageCreateUninitCtx(ImageContext ctx, int width, int height, uint8 maxval)
+{ ///
+  return imageCreateRaw(ctx, width, height, maxval);
+}
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -209,10 +476,21 @@ Image ImageCreate(int width, int height, uint8 maxval)
 void ImageDestroy(Image *imgp)
 { ///
   assert(imgp != NULL);
-  // Insert your code here!
-  free((*imgp)->pixel);
+  if (*imgp == NULL)
+    return;
+  errsave = errno;
+  ImageContext ctx = (*imgp)->ctx;
+  poolFree(poolOf(ctx), (*imgp)->pixel, (size_t)(*imgp)->width * (*imgp)->height);
+  if (ctx != NULL)
+  {
+    pthread_mutex_lock(&ctx->pool.lock);
+    assert(ctx->images > 0);
+    ctx->images--;
+    pthread_mutex_unlock(&ctx->pool.lock);
+  }
   free(*imgp);
   *imgp = NULL;
+  errno = errsave;
 }
 
 /// PGM file operations
@@ -236,10 +514,21 @@ static int skipComments(FILE *f)
 
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
+/// Raw PBM files are accepted too, as images with maxval PixMax
+/// (see BitmapToImage).
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char *filename)
+{ ///
+  return ImageLoadCtx(NULL, filename);
+}
+
+// Defined with the bitmap functions
+static Image bitmapToImage(ImageContext ctx, Bitmap bmp, uint8 maxval);
+
+/// Load a raw PGM (or PBM) file into a new image in context ctx.
+Image ImageLoadCtx(ImageContext ctx, const char *filename)
 { ///
   int w, h;
   int maxval;
@@ -249,8 +538,18 @@ Image ImageLoad(const char *filename)
 
   int success =
       check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      check(fscanf(f, "P%c ", &c) == 1 && (c == '5' || c == '4'), "Invalid file format");
+  if (success && c == '4')
+  { // Raw PBM file
+    fclose(f);
+    Bitmap bmp = BitmapLoad(filename);
+    if (bmp != NULL)
+      img = bitmapToImage(ctx, bmp, PixMax);
+    BitmapDestroy(&bmp);
+    return img;
+  }
+  success = success &&
       // Parse PGM header
-      check(fscanf(f, "P%c ", &c) == 1 && c == '5', "Invalid file format") &&
       skipComments(f) >= 0 &&
       check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width") &&
       skipComments(f) >= 0 &&
@@ -258,11 +557,12 @@ Image ImageLoad(const char *filename)
       skipComments(f) >= 0 &&
       check(fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax, "Invalid maxval") &&
       check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected") &&
-      // Allocate image
-      (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+      // Allocate image (every pixel is read from the file)
+      (img = imageCreateRaw(ctx, w, h, (uint8)maxval)) != NULL &&
       // Read pixels
-      check(fread(img->pixel, sizeof(uint8), w * h, f) == w * h, "Reading pixels");
-  PIXMEM += (unsigned long)(w * h); // count pixel memory accesses
+      check(fread(img->pixel, sizeof(uint8), w * h, f) == (size_t)w * h, "Reading pixels");
+  INSTR_BULK(PIXMEM, (unsigned long)(w * h)); // count pixel memory accesses
+  COUNTPIXELS((unsigned long)(w * h), (unsigned long)(w * h));
 
   // Cleanup
   if (!success)
@@ -291,12 +591,127 @@ int ImageSave(Image img, const char *filename)
   int success =
       check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
       check(fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed") &&
-      check(fwrite(img->pixel, sizeof(uint8), w * h, f) == w * h, "Writing pixels failed");
-  PIXMEM += (unsigned long)(w * h); // count pixel memory accesses
+      check(fwrite(img->pixel, sizeof(uint8), w * h, f) == (size_t)w * h, "Writing pixels failed");
+  INSTR_BULK(PIXMEM, (unsigned long)(w * h)); // count pixel memory accesses
+  COUNTPIXELS((unsigned long)(w * h), (unsigned long)(w * h));
+
+  // Cleanup
+  if (f != NULL)
+    fclose(f);
+  return success;
+}
+
+/// Synthetic images
+
+// Hash of a seed and a pixel index (the splitmix64 finalizer):
+// good enough statistically, and each pixel is independent of the others.
+static unsigned long long synthHash(unsigned long seed, unsigned long long i)
+{
+  unsigned long long z = (unsigned long long)seed * 0x9E3779B97F4A7C15ull + i;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+// Compute row y of a width x height synthetic image.
+static void synthRow(uint8 *row, int width, int height, int y, ImageSynthModel model,
+                     unsigned long seed)
+{
+  unsigned long long base = (unsigned long long)y * width;
+  switch (model)
+  {
+  case SYNTH_NOISE:
+    for (int x = 0; x < width; x++)
+      row[x] = (uint8)synthHash(seed, base + x);
+    break;
+  case SYNTH_GRADIENT:
+    for (int x = 0; x < width; x++)
+    {
+      int level = (int)((255ll * x / (width > 1 ? width - 1 : 1) +
+                         255ll * y / (height > 1 ? height - 1 : 1)) / 2);
+      level += (int)(synthHash(seed, base + x) % 5) - 2; // noise in [-2, 2]
+      row[x] = (uint8)(level < 0 ? 0 : level > 255 ? 255 : level);
+    }
+    break;
+  case SYNTH_BLOCKS:
+    for (int x = 0; x < width; x++)
+    { // Same hash for all pixels of a block
+      unsigned long long block = (unsigned long long)(y / 16) * ((width + 15) / 16) + x / 16;
+      row[x] = (uint8)(synthHash(seed, block) % 4 * 85);
+    }
+    break;
+  case SYNTH_NEARMATCH:
+    memset(row, 0, width);
+    break;
+  }
+}
+
+/// Create a synthetic image.
+Image ImageSynthetic(int width, int height, ImageSynthModel model, unsigned long seed)
+{ ///
+  assert(width >= 0);
+  assert(height >= 0);
+  Image img = imageCreateRaw(NULL, width, height, PixMax);
+  if (img == NULL)
+  {
+    return NULL;
+  }
+  for (int y = 0; y < height; y++)
+  {
+    synthRow(img->pixel + (size_t)y * width, width, height, y, model, seed);
+  }
+  COUNTPIXELS((unsigned long)width * height, (unsigned long)width * height);
+  return img;
+}
+
+/// Create a template for synthetic images.
+Image ImageSyntheticTemplate(int width, int height, ImageSynthModel model, unsigned long seed)
+{ ///
+  assert(width > 0);
+  assert(height > 0);
+  if (model != SYNTH_NEARMATCH)
+  {
+    return ImageSynthetic(width, height, SYNTH_NOISE, seed);
+  }
+  Image tmpl = ImageCreate(width, height, PixMax);
+  if (tmpl != NULL)
+  {
+    tmpl->pixel[(size_t)width * height - 1] = PixMax;
+  }
+  return tmpl;
+}
+
+/// Save a synthetic image to a PGM file, one row at a time.
+int ImageSaveSynthetic(const char *filename, int width, int height, ImageSynthModel model,
+                       unsigned long seed, Image tmpl, int x, int y)
+{ ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(tmpl == NULL || (x >= 0 && y >= 0 && x + tmpl->width <= width && y + tmpl->height <= height));
+  FILE *f = NULL;
+  uint8 *row = NULL;
+
+  int success =
+      check((row = malloc(width > 0 ? width : 1)) != NULL, "Allocating row") &&
+      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fprintf(f, "P5\n%d %d\n%u\n", width, height, (unsigned)PixMax) > 0, "Writing header failed");
+  for (int j = 0; success && j < height; j++)
+  {
+    synthRow(row, width, height, j, model, seed);
+    if (tmpl != NULL && j >= y && j < y + tmpl->height)
+    {
+      memcpy(row + x, tmpl->pixel + (size_t)(j - y) * tmpl->width, tmpl->width);
+    }
+    success = check(fwrite(row, sizeof(uint8), width, f) == (size_t)width, "Writing pixels failed");
+  }
+  COUNTPIXELS((unsigned long)width * height, (unsigned long)width * height);
 
   // Cleanup
+  errsave = errno;
   if (f != NULL)
     fclose(f);
+  free(row);
+  errno = errsave;
   return success;
 }
 
@@ -337,7 +752,7 @@ void ImageStats(Image img, uint8 *min, uint8 *max)
   uint8 pixel;
   *min = *max = ImageGetPixel(img, 0, 0); // Initialize min and max with first pixel
 
-  for (size_t i = 0; i < img->width * img->height; i++) // we multiply the width with the height to have all the indices of the pixel array
+  for (size_t i = 0; i < (size_t)img->width * img->height; i++) // we multiply the width with the height to have all the indices of the pixel array
   {
     pixel = img->pixel[i];
     if (pixel < *min)
@@ -349,6 +764,7 @@ void ImageStats(Image img, uint8 *min, uint8 *max)
       *max = pixel;
     }
   }
+  COUNTPIXELS((unsigned long)img->width * img->height, (unsigned long)img->width * img->height);
 }
 
 /// Check if pixel position (x,y) is inside img.
@@ -392,7 +808,7 @@ uint8 ImageGetPixel(Image img, int x, int y)
 { ///
   assert(img != NULL);
   assert(ImageValidPos(img, x, y));
-  PIXMEM += 1; // count one pixel access (read)
+  INSTR_OP(PIXMEM, 1); // count one pixel access (read)
   return img->pixel[G(img, x, y)];
 }
 
@@ -401,10 +817,81 @@ void ImageSetPixel(Image img, int x, int y, uint8 level)
 { ///
   assert(img != NULL);
   assert(ImageValidPos(img, x, y));
-  PIXMEM += 1; // count one pixel access (store)
+  INSTR_OP(PIXMEM, 1); // count one pixel access (store)
   img->pixel[G(img, x, y)] = level;
 }
 
+/// Bulk pixel access
+
+// These are counted by PIXMEM as the equivalent loops of
+// ImageGetPixel/ImageSetPixel, except for the row pointers, which cannot be.
+
+/// Get a pointer to the first pixel of row y (to read only).
+const uint8 *ImageRowPtr(Image img, int y)
+{ ///
+  assert(img != NULL);
+  assert(0 <= y && y < img->height);
+  return img->pixel + (size_t)y * img->width;
+}
+
+/// Get a pointer to the first pixel of row y (to read and write).
+uint8 *ImageMutableRowPtr(Image img, int y)
+{ ///
+  assert(img != NULL);
+  assert(0 <= y && y < img->height);
+  return img->pixel + (size_t)y * img->width;
+}
+
+/// Copy n pixels of row y, from position (x,y), to buf[0..n-1].
+void ImageGetRow(Image img, int y, int x, int n, uint8 *buf)
+{ ///
+  assert(img != NULL);
+  assert(ImageValidRect(img, x, y, n, 1));
+  assert(buf != NULL || n == 0);
+  INSTR_BULK(PIXMEM, n); // count n pixel accesses (read)
+  memcpy(buf, img->pixel + (size_t)y * img->width + x, (size_t)n);
+}
+
+/// Copy buf[0..n-1] to n pixels of row y, from position (x,y).
+void ImageSetRow(Image img, int y, int x, int n, const uint8 *buf)
+{ ///
+  assert(img != NULL);
+  assert(ImageValidRect(img, x, y, n, 1));
+  assert(buf != NULL || n == 0);
+  INSTR_BULK(PIXMEM, n); // count n pixel accesses (store)
+  memcpy(img->pixel + (size_t)y * img->width + x, buf, (size_t)n);
+}
+
+/// Gather the pixels at n positions (xs[i],ys[i]) into buf[0..n-1].
+void ImageGather(Image img, int n, const int *xs, const int *ys, uint8 *buf)
+{ ///
+  assert(img != NULL);
+  assert(n == 0 || (xs != NULL && ys != NULL && buf != NULL));
+  const uint8 *pixel = img->pixel;
+  int w = img->width;
+  for (int i = 0; i < n; i++)
+  {
+    assert(ImageValidPos(img, xs[i], ys[i]));
+    buf[i] = pixel[(size_t)ys[i] * w + xs[i]];
+  }
+  INSTR_BULK(PIXMEM, n); // count n pixel accesses (read)
+}
+
+/// Scatter buf[0..n-1] to the pixels at n positions (xs[i],ys[i]).
+void ImageScatter(Image img, int n, const int *xs, const int *ys, const uint8 *buf)
+{ ///
+  assert(img != NULL);
+  assert(n == 0 || (xs != NULL && ys != NULL && buf != NULL));
+  uint8 *pixel = img->pixel;
+  int w = img->width;
+  for (int i = 0; i < n; i++)
+  {
+    assert(ImageValidPos(img, xs[i], ys[i]));
+    pixel[(size_t)ys[i] * w + xs[i]] = buf[i];
+  }
+  INSTR_BULK(PIXMEM, n); // count n pixel accesses (store)
+}
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
@@ -419,10 +906,11 @@ void ImageNegative(Image img)
 { ///
   assert(img != NULL);
   // Insert your code here!
-  for (size_t i = 0; i < img->width * img->height; i++) // we multiply the width with the height to have all the indices of the pixel array
+  for (size_t i = 0; i < (size_t)img->width * img->height; i++) // we multiply the width with the height to have all the indices of the pixel array
   {
     img->pixel[i] = 255 - img->pixel[i]; // To transform to negative, we subtract the current level from 255 (Eg.Past=15 New=255-15=240; Past=240 New=255-240=15)
   }
+  COUNTPIXELS((unsigned long)img->width * img->height, 2ul * img->width * img->height);
 }
 
 /// Apply threshold to image.
@@ -435,7 +923,7 @@ void ImageThreshold(Image img, uint8 thr)
   uint8 black = 0;
   uint8 white = img->maxval;
 
-  for (size_t i = 0; i < img->width * img->height; i++) // we multiply the width with the height to have all the indices of the pixel array
+  for (size_t i = 0; i < (size_t)img->width * img->height; i++) // we multiply the width with the height to have all the indices of the pixel array
   {
     if (img->pixel[i] < thr)
     {
@@ -446,6 +934,7 @@ void ImageThreshold(Image img, uint8 thr)
       img->pixel[i] = white;
     }
   }
+  COUNTPIXELS((unsigned long)img->width * img->height, 2ul * img->width * img->height);
 }
 
 /// Brighten image by a factor.
@@ -459,7 +948,7 @@ void ImageBrighten(Image img, double factor)
   // Insert your code here!
   double newLevel;
 
-  for (size_t i = 0; i < img->width * img->height; i++) // we multiply the width with the height to have all the indices of the pixel array
+  for (size_t i = 0; i < (size_t)img->width * img->height; i++) // we multiply the width with the height to have all the indices of the pixel array
   {
     newLevel = img->pixel[i] * factor + 0.5; // Multiply current level by factor  (+0.5 so it rounds up)
 
@@ -470,6 +959,22 @@ void ImageBrighten(Image img, double factor)
 
     img->pixel[i] = (uint8)newLevel;
   }
+  COUNTPIXELS((unsigned long)img->width * img->height, 2ul * img->width * img->height);
+}
+
+/// Map pixel levels through a lookup table.
+/// Replace each pixel level v by table[v].
+/// table must have 256 entries (one per possible level).
+void ImageMapLevels(Image img, const uint8 *table)
+{ ///
+  assert(img != NULL);
+  assert(table != NULL);
+  size_t size = (size_t)img->width * img->height;
+  for (size_t i = 0; i < size; i++)
+  {
+    img->pixel[i] = table[img->pixel[i]];
+  }
+  COUNTPIXELS((unsigned long)img->width * img->height, 2ul * img->width * img->height);
 }
 
 /// Geometric transformations
@@ -485,78 +990,363 @@ void ImageBrighten(Image img, double factor)
 // Implementation hint:
 // Call ImageCreate whenever you need a new image!
 
-/// Rotate an image.
-/// Returns a rotated version of the image.
-/// The rotation is 90 degrees anti-clockwise.
-/// Ensures: The original img is not modified.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageRotate(Image img)
-{ ///
-  assert(img != NULL);
-  // Insert your code here!
-  // Image rotatedImg = ImageCreate(img->height, img->width, img->maxval); // Create a new image with swapped dimensions because of the rotated context
-  Image rotatedImg = ImageCreate(img->height, img->width, img->maxval); // Create a new image with swapped dimensions because of the rotated context
+// Geometric transformations write their result with plain index
+// arithmetic on the pixel arrays.  The PIXMEM counter is incremented in
+// bulk, one read and one write per pixel, which is what the equivalent
+// ImageGetPixel/ImageSetPixel loop would count.
+
+// Side of the square tiles used to traverse images in cache-friendly order.
+// A tile of the source and the corresponding tile of the destination
+// (2 x 64 x 64 bytes) fit comfortably in L1 cache.
+#define TILE 64
+
+/// Dihedral transformations
+
+// Each orientation is described by the 2x2 matrix {m00, m01, m10, m11}
+// that maps source coordinates to destination coordinates, both taken
+// relative to the image center:
+//   x' = m00*x + m01*y
+//   y' = m10*x + m11*y
+// Entries are -1, 0 or 1, and the order matches enum ImageOrientation.
+static const int orientMatrix[8][4] = {
+    {1, 0, 0, 1},   // ORIENT_IDENTITY
+    {0, 1, -1, 0},  // ORIENT_ROT90: (x,y) -> (y, w-1-x)
+    {-1, 0, 0, -1}, // ORIENT_ROT180
+    {0, -1, 1, 0},  // ORIENT_ROT270: (x,y) -> (h-1-y, x)
+    {-1, 0, 0, 1},  // ORIENT_FLIPX
+    {1, 0, 0, -1},  // ORIENT_FLIPY
+    {0, 1, 1, 0},   // ORIENT_TRANSPOSE
+    {0, -1, -1, 0}, // ORIENT_ANTITRANSPOSE
+};
 
-  if (rotatedImg == NULL)
+/// Compose two orientations.
+/// Returns the orientation equivalent to applying first, then second.
+ImageOrientation ImageOrientationCompose(ImageOrientation first, ImageOrientation second)
+{ ///
+  assert(0 <= first && first < 8);
+  assert(0 <= second && second < 8);
+  const int *a = orientMatrix[first];
+  const int *b = orientMatrix[second];
+  // Matrix product b*a
+  int m[4] = {
+      b[0] * a[0] + b[1] * a[2], b[0] * a[1] + b[1] * a[3],
+      b[2] * a[0] + b[3] * a[2], b[2] * a[1] + b[3] * a[3]};
+  for (int o = 0; o < 8; o++)
   {
-    errsave = errno;
-    errno = errsave;
-    return NULL;
+    const int *c = orientMatrix[o];
+    if (c[0] == m[0] && c[1] == m[1] && c[2] == m[2] && c[3] == m[3])
+      return (ImageOrientation)o;
   }
+  assert(0); // the group is closed, so this is unreachable
+  return ORIENT_IDENTITY;
+}
 
-  int rotatedX, rotatedY;
-
-  int maxY = img->width - 1; // Max Y coordinate
+/// Check if orientation o swaps the image axes.
+/// (The transformed image then has width and height exchanged.)
+int ImageOrientationSwapsAxes(ImageOrientation o)
+{ ///
+  assert(0 <= o && o < 8);
+  return orientMatrix[o][0] == 0;
+}
 
-  // Rotate Loop
-  for (int y = 0; y < img->height; y++)
+// Transform src into dst according to orientation o.
+// This is the kernel for all geometric transformations of the D4 group.
+// It traverses dst in tiles, in raster order within each tile, and for
+// each destination pixel reads the source pixel at
+//   base + X*stepX + Y*stepY
+// where the steps follow from the inverse (transposed) matrix.
+// For orientations that keep rows contiguous (stepX == 1) whole rows are
+// copied instead.
+static void transformPixels(Image dst, Image src, ImageOrientation o)
+{
+  const int *m = orientMatrix[o];
+  int w = src->width;
+  int h = src->height;
+  int dw = dst->width;
+  int dh = dst->height;
+  // Source coords: x = m00*X + m10*Y + cx,  y = m01*X + m11*Y + cy
+  ptrdiff_t cx = (m[0] < 0 || m[2] < 0) ? w - 1 : 0;
+  ptrdiff_t cy = (m[1] < 0 || m[3] < 0) ? h - 1 : 0;
+  ptrdiff_t base = cx + cy * w;
+  ptrdiff_t stepX = m[0] + (ptrdiff_t)m[1] * w;
+  ptrdiff_t stepY = m[2] + (ptrdiff_t)m[3] * w;
+
+  if (stepX == 1)
   {
-    for (int x = 0; x < img->width; x++)
+    for (int Y = 0; Y < dh; Y++)
     {
-      rotatedX = y; // The new X coordinate is the current Y coordinate
-      rotatedY = maxY - x;
-      // ImageGetPixel(img, x, y) returns the level of the pixel in the original position
-      ImageSetPixel(rotatedImg, rotatedX, rotatedY, ImageGetPixel(img, x, y)); // Set the level of the original pixel to the rotated position
+      memcpy(dst->pixel + (size_t)Y * dw, src->pixel + base + Y * stepY, dw);
     }
   }
+  else
+  {
+    for (int ty = 0; ty < dh; ty += TILE)
+    {
+      int ymax = ty + TILE < dh ? ty + TILE : dh;
+      for (int tx = 0; tx < dw; tx += TILE)
+      {
+        int xmax = tx + TILE < dw ? tx + TILE : dw;
+        for (int Y = ty; Y < ymax; Y++)
+        {
+          uint8 *drow = dst->pixel + (size_t)Y * dw;
+          const uint8 *s = src->pixel + base + Y * stepY + tx * stepX;
+          for (int X = tx; X < xmax; X++, s += stepX)
+          {
+            drow[X] = *s;
+          }
+        }
+      }
+    }
+  }
+  INSTR_BULK(PIXMEM, 2ul * w * h); // count pixel memory accesses
+  COUNTPIXELS((unsigned long)w * h, 2ul * w * h);
+}
 
-  return rotatedImg;
+/// Transform an image into a given destination.
+/// Writes into dst the image src transformed according to orientation o.
+/// Requires: dst != src,
+///   dst has the size of src, with width and height exchanged if
+///   ImageOrientationSwapsAxes(o).
+/// Ensures: src is not modified, dst maxval is set to src maxval.
+/// This never fails and involves no allocation.
+void ImageTransformInto(Image dst, Image src, ImageOrientation o)
+{ ///
+  assert(dst != NULL);
+  assert(src != NULL);
+  assert(dst != src);
+  assert(0 <= o && o < 8);
+  if (ImageOrientationSwapsAxes(o))
+    assert(dst->width == src->height && dst->height == src->width);
+  else
+    assert(dst->width == src->width && dst->height == src->height);
+  dst->maxval = src->maxval;
+  transformPixels(dst, src, o);
 }
 
-/// Mirror an image = flip left-right.
-/// Returns a mirrored version of the image.
+/// Transform an image.
+/// Returns a version of img transformed according to orientation o.
 /// Ensures: The original img is not modified.
 ///
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageMirror(Image img)
+Image ImageTransform(Image img, ImageOrientation o)
 { ///
   assert(img != NULL);
-  // Insert your code here!
-  Image mirroredImg = ImageCreate(img->width, img->height, img->maxval);
-  if (mirroredImg == NULL)
+  assert(0 <= o && o < 8);
+  Image newImg = ImageOrientationSwapsAxes(o)
+                     ? imageCreateRaw(img->ctx, img->height, img->width, img->maxval)
+                     : imageCreateRaw(img->ctx, img->width, img->height, img->maxval);
+  if (newImg == NULL)
   {
-    errsave = errno;
-    errno = errsave;
     return NULL;
   }
+  transformPixels(newImg, img, o);
+  return newImg;
+}
 
-  int maxX = img->width - 1; // Max X coordinate
-
-  // Mirror Loop
-  for (int x = 0; x < img->width; x++)
-  {
-    for (int y = 0; y < img->height; y++)
-    {
-      // ImageGetPixel(img, maxX - x, y) returns the level of the pixel in the mirrored position
-      ImageSetPixel(mirroredImg, x, y, ImageGetPixel(img, maxX - x, y)); // Set the level of the mirrored pixel to the new image
-    }
-  }
-  return mirroredImg;
+/// Rotate an image into a given destination.
+/// Writes into dst a version of src rotated 90 degrees anti-clockwise.
+/// Requires: dst != src,
+///   dst width == src height, dst height == src width.
+/// Ensures: src is not modified, dst maxval is set to src maxval.
+/// This never fails and involves no allocation.
+void ImageRotateInto(Image dst, Image src)
+{ ///
+  assert(dst != NULL);
+  assert(src != NULL);
+  assert(dst != src);
+  assert(dst->width == src->height && dst->height == src->width);
+  dst->maxval = src->maxval;
+  transformPixels(dst, src, ORIENT_ROT90);
+}
+
+/// Rotate an image.
+/// Returns a rotated version of the image.
+/// The rotation is 90 degrees anti-clockwise.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate(Image img)
+{ ///
+  assert(img != NULL);
+  // Create a new image with swapped dimensions because of the rotated context
+  Image rotatedImg = imageCreateRaw(img->ctx, img->height, img->width, img->maxval);
+  if (rotatedImg == NULL)
+  {
+    return NULL;
+  }
+  ImageRotateInto(rotatedImg, img);
+  return rotatedImg;
+}
+
+/// In-place rotations
+
+// Rotating a square image by 90 degrees moves each pixel along a cycle of
+// 4 positions: (x,y) -> (y,n-1-x) -> (n-1-x,n-1-y) -> (n-1-y,x) -> (x,y).
+// Rotating one representative of each cycle, taken from the top left
+// quadrant, rotates the whole image with a single temporary variable.
+// The quadrant is traversed in tiles, so that the 4 tiles touched by a
+// tile of representatives (2 of them read and written along columns) stay
+// in cache while they are processed.
+
+// Rotate a square image in-place by 90 degrees.
+// Anti-clockwise if ccw is nonzero, clockwise otherwise.
+static void rotateSquareInPlace(Image img, int ccw)
+{
+  int n = img->width;
+  uint8 *p = img->pixel;
+  int xend = (n + 1) / 2; // representatives: x in [0, (n+1)/2)
+  int yend = n / 2;       //                  y in [0, n/2)
+  for (int ty = 0; ty < yend; ty += TILE)
+  {
+    int ymax = ty + TILE < yend ? ty + TILE : yend;
+    for (int tx = 0; tx < xend; tx += TILE)
+    {
+      int xmax = tx + TILE < xend ? tx + TILE : xend;
+      for (int y = ty; y < ymax; y++)
+      {
+        for (int x = tx; x < xmax; x++)
+        {
+          size_t p0 = (size_t)y * n + x;
+          size_t p1 = (size_t)(n - 1 - x) * n + y;
+          size_t p2 = (size_t)(n - 1 - y) * n + (n - 1 - x);
+          size_t p3 = (size_t)x * n + (n - 1 - y);
+          uint8 t = p[p0];
+          if (ccw)
+          { // pixel at p0 goes to p1, p1 to p2, p2 to p3, p3 to p0
+            p[p0] = p[p3];
+            p[p3] = p[p2];
+            p[p2] = p[p1];
+            p[p1] = t;
+          }
+          else
+          { // the other way around
+            p[p0] = p[p1];
+            p[p1] = p[p2];
+            p[p2] = p[p3];
+            p[p3] = t;
+          }
+        }
+      }
+    }
+  }
+  INSTR_BULK(PIXMEM, 2ul * n * n); // count pixel memory accesses
+  COUNTPIXELS((unsigned long)n * n, 2ul * n * n);
+}
+
+/// Rotate a square image in-place, 90 degrees anti-clockwise.
+/// Same result as ImageRotate, but needs no second image.
+/// Requires: img width == img height.
+void ImageRotateInPlace(Image img)
+{ ///
+  assert(img != NULL);
+  assert(img->width == img->height);
+  rotateSquareInPlace(img, 1);
+}
+
+/// Rotate a square image in-place, 90 degrees clockwise.
+/// Requires: img width == img height.
+void ImageRotateClockwiseInPlace(Image img)
+{ ///
+  assert(img != NULL);
+  assert(img->width == img->height);
+  rotateSquareInPlace(img, 0);
+}
+
+/// Rotate an image in-place by 180 degrees.
+/// Works for any image size.
+void ImageRotate180(Image img)
+{ ///
+  assert(img != NULL);
+  int w = img->width;
+  int h = img->height;
+  // Row y is swapped with the reversed row h-1-y.
+  // Both rows are traversed sequentially, in opposite directions.
+  for (int y = 0; y < h / 2; y++)
+  {
+    uint8 *top = img->pixel + (size_t)y * w;
+    uint8 *bottom = img->pixel + (size_t)(h - 1 - y) * w;
+    for (int x = 0; x < w; x++)
+    {
+      uint8 t = top[x];
+      top[x] = bottom[w - 1 - x];
+      bottom[w - 1 - x] = t;
+    }
+  }
+  if (h % 2 == 1)
+  { // the middle row is just reversed
+    uint8 *mid = img->pixel + (size_t)(h / 2) * w;
+    for (int x = 0; x < w / 2; x++)
+    {
+      uint8 t = mid[x];
+      mid[x] = mid[w - 1 - x];
+      mid[w - 1 - x] = t;
+    }
+  }
+  INSTR_BULK(PIXMEM, 2ul * w * h); // count pixel memory accesses
+  COUNTPIXELS((unsigned long)w * h, 2ul * w * h);
+}
+
+/// Mirror an image into a given destination.
+/// Writes into dst a version of src flipped left-right.
+/// Requires: dst != src, dst and src have the same size.
+/// Ensures: src is not modified, dst maxval is set to src maxval.
+/// This never fails and involves no allocation.
+void ImageMirrorInto(Image dst, Image src)
+{ ///
+  assert(dst != NULL);
+  assert(src != NULL);
+  assert(dst != src);
+  assert(dst->width == src->width && dst->height == src->height);
+  dst->maxval = src->maxval;
+  transformPixels(dst, src, ORIENT_FLIPX);
+}
+
+/// Mirror an image = flip left-right.
+/// Returns a mirrored version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageMirror(Image img)
+{ ///
+  assert(img != NULL);
+  Image mirroredImg = imageCreateRaw(img->ctx, img->width, img->height, img->maxval);
+  if (mirroredImg == NULL)
+  {
+    return NULL;
+  }
+  ImageMirrorInto(mirroredImg, img);
+  return mirroredImg;
+}
+
+/// Crop a rectangular subimage into a given destination.
+/// Copies into dst the rectangle of src with top left corner (x, y)
+/// and the same width and height as dst.
+/// Requires: dst != src,
+///   the rectangle (x, y, dst width, dst height) must be inside src.
+/// Ensures: src is not modified, dst maxval is set to src maxval.
+/// This never fails and involves no allocation.
+void ImageCropInto(Image dst, Image src, int x, int y)
+{ ///
+  assert(dst != NULL);
+  assert(src != NULL);
+  assert(dst != src);
+  assert(ImageValidRect(src, x, y, dst->width, dst->height));
+  int w = dst->width;
+  int h = dst->height;
+  dst->maxval = src->maxval;
+
+  for (int j = 0; j < h; j++)
+  {
+    memcpy(dst->pixel + (size_t)j * w, src->pixel + (size_t)(y + j) * src->width + x, w);
+  }
+  INSTR_BULK(PIXMEM, 2ul * w * h); // count pixel memory accesses
+  COUNTPIXELS((unsigned long)w * h, 2ul * w * h);
 }
 
 /// Crop a rectangular subimage from img.
@@ -575,25 +1365,12 @@ Image ImageCrop(Image img, int x, int y, int w, int h)
 { ///
   assert(img != NULL);
   assert(ImageValidRect(img, x, y, w, h));
-  // Insert your code here!
-  Image croppedImg = ImageCreate(w, h, img->maxval);
+  Image croppedImg = imageCreateRaw(img->ctx, w, h, img->maxval);
   if (croppedImg == NULL)
   {
-    errsave = errno;
-    errno = errsave;
     return NULL;
   }
-
-  // Crop Loop
-  for (int i = 0; i < w; i++)
-  {
-    for (int j = 0; j < h; j++)
-    {
-      // If the begining of the subimage is at (x,y), then the pixel at (i,j) needs to be the pixel at (x+i,y+j) in the original image
-      // ImageGetPixel(img, x + i, y + j) returns the level of the pixel in the original image
-      ImageSetPixel(croppedImg, i, j, ImageGetPixel(img, x + i, y + j)); // Set the level of the cropped pixel to the new image
-    }
-  }
+  ImageCropInto(croppedImg, img, x, y);
   return croppedImg;
 }
 
@@ -608,16 +1385,15 @@ void ImagePaste(Image img1, int x, int y, Image img2)
   assert(img1 != NULL);
   assert(img2 != NULL);
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
-  // Insert your code here!
-  // This for loop goes through the subimage and sets the pixels of the image1 to the pixels of the subimage at position (i,j)
-  for (int i = 0; i < img2->width; i++)
+  int w = img2->width;
+  int h = img2->height;
+  // Row j of img2 goes to row y+j of img1, starting at column x
+  for (int j = 0; j < h; j++)
   {
-    for (int j = 0; j < img2->height; j++)
-    {
-      // Because the subimage needs to be at position (x,y), its pixels need to be at position (x+i,y+j) in the image1
-      ImageSetPixel(img1, x + i, y + j, ImageGetPixel(img2, i, j));
-    }
+    memcpy(img1->pixel + (size_t)(y + j) * img1->width + x, img2->pixel + (size_t)j * w, w);
   }
+  INSTR_BULK(PIXMEM, 2ul * w * h); // count pixel memory accesses
+  COUNTPIXELS((unsigned long)w * h, 2ul * w * h);
 }
 
 /// Blend an image into a larger image.
@@ -631,29 +1407,34 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha)
   assert(img1 != NULL);
   assert(img2 != NULL);
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
-  // Insert your code here!
+  int w = img2->width;
+  int h = img2->height;
   double img2newLevel;
 
   // Basically the same as ImagePaste, however, now the pixels level of the subimage are multiplied by alpha
-  for (int i = 0; i < img2->width; i++)
+  for (int j = 0; j < h; j++)
   {
-    for (int j = 0; j < img2->height; j++)
+    uint8 *row1 = img1->pixel + (size_t)(y + j) * img1->width + x;
+    const uint8 *row2 = img2->pixel + (size_t)j * w;
+    for (int i = 0; i < w; i++)
     {
-      // ImageGetPixel(img1, x+i, y+j) returns the level of the pixel in the original image
-      // ImageGetPixel(img2, i, j) returns the level of the pixel in the subimage
+      // row1[i] is the level of the pixel in the original image
+      // row2[i] is the level of the pixel in the subimage
       // To blend the images, we need to achieve the intermediate level between the two images
       // Alpha is the value that determines the weight of the subimage
       // 1 - alpha is the value that determines the weight of the original image
       // In that way, if alpha is 0, the original image stays the same
       // If alpha is 1, the subimage stays pure in the original image
-      img2newLevel = (1.0 - alpha) * ImageGetPixel(img1, x + i, y + j) + ImageGetPixel(img2, i, j) * alpha + 0.5;
+      img2newLevel = (1.0 - alpha) * row1[i] + row2[i] * alpha + 0.5;
       if (img2newLevel < 0)
         img2newLevel = 0; // If the new level is less than 0, saturate it to 0
       if (img2newLevel > img1->maxval)
         img2newLevel = img1->maxval; // If the new level is greater than maxval, saturate it to maxval
-      ImageSetPixel(img1, x + i, y + j, (uint8)img2newLevel);
+      row1[i] = (uint8)img2newLevel;
     }
   }
+  INSTR_BULK(PIXMEM, 3ul * w * h); // count pixel memory accesses
+  COUNTPIXELS((unsigned long)w * h, 3ul * w * h);
 }
 
 /// Compare an image to a subimage of a larger image.
@@ -670,16 +1451,59 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2)
   {
     for (int j = 0; j < img2->height; j++)
     {
-      ITERATIONS++;
       if (ImageGetPixel(img1, x + i, y + j) != (ImageGetPixel(img2, i, j)))
       {
+        INSTR_BULK(ITERATIONS, (unsigned long)i * img2->height + j + 1);
+        COUNTPIXELS((unsigned long)i * img2->height + j + 1, 2 * ((unsigned long)i * img2->height + j + 1));
         return 0;
       }
     }
   }
+  INSTR_BULK(ITERATIONS, (unsigned long)img2->width * img2->height);
+  COUNTPIXELS((unsigned long)img2->width * img2->height, 2ul * img2->width * img2->height);
   return 1;
 }
 
+// Locate img2 inside img1 comparing whole rows of pixels (LOCATE_ROWS).
+// The positions are tried in the same order as ImageLocateSubImage,
+// so the result is the same.
+static int locateRows(Image img1, int *px, int *py, Image img2)
+{
+  int w1 = img1->width;
+  int w2 = img2->width;
+  int h2 = img2->height;
+  unsigned long compared = 0; // pixels compared, up to the first mismatch
+  int found = 0;
+  for (int x = 0; x <= w1 - w2 && !found; x++)
+  {
+    for (int y = 0; y <= img1->height - h2 && !found; y++)
+    {
+      const uint8 *pos = img1->pixel + (size_t)y * w1 + x;
+      int j = 0;
+      while (j < h2 && memcmp(pos + (size_t)j * w1, img2->pixel + (size_t)j * w2, w2) == 0)
+        j++;
+      if (j == h2)
+      {
+        compared += (unsigned long)w2 * h2;
+        *px = x;
+        *py = y;
+        found = 1;
+      }
+      else
+      { // Count the pixels of row j up to the mismatch
+        int i = 0;
+        while (pos[(size_t)j * w1 + i] == img2->pixel[(size_t)j * w2 + i])
+          i++;
+        compared += (unsigned long)j * w2 + i + 1;
+      }
+    }
+  }
+  INSTR_BULK(ITERATIONS, compared);
+  INSTR_BULK(PIXMEM, 2 * compared); // count pixel memory accesses
+  COUNTPIXELS(compared, 2 * compared);
+  return found;
+}
+
 /// Locate a subimage inside another image.
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
@@ -688,6 +1512,8 @@ int ImageLocateSubImage(Image img1, int *px, int *py, Image img2)
 { ///
   assert(img1 != NULL);
   assert(img2 != NULL);
+  if (ImageStrategy(TUNE_LOCATE, img1->width, img1->height, img2->width * img2->height) == LOCATE_ROWS)
+    return locateRows(img1, px, py, img2);
   // Insert your code here!
   for (int x = 0; x <= img1->width - img2->width; x++)     // img1->width - img2->width because we can't check a position where img1->width - x is less than img2->width
   {                                                        // Doing that would cause an error in ImageMatchSubImage
@@ -705,60 +1531,293 @@ int ImageLocateSubImage(Image img1, int *px, int *py, Image img2)
 }
 
 /// Filtering
-static unsigned long **calculeCumulativeSums(Image img)
+
+// Compute the integral image (summed-area table) of img.
+// Returns an array of width*height sums in raster order, where the sum at
+// (x, y) is the sum of all pixels in the rectangle [0, x]x[0, y],
+// or NULL on failure (errno/errCause are set).
+// (The caller is responsible for freeing the returned array!)
+static unsigned long *integralImage(Image img)
 {
-  // Allocate the cumulativeSums matrix (width x height) but first allocate the width
-  unsigned long **cumulativeSums = (unsigned long **)malloc(img->width * sizeof(unsigned long *));
-  if (cumulativeSums == NULL)
+  int w = img->width;
+  int h = img->height;
+  unsigned long *sums = malloc((size_t)w * h * sizeof(unsigned long));
+  if (!check(sums != NULL, "Allocating integral image"))
   {
-    errsave = errno;
-    errno = errsave;
     return NULL;
   }
 
-  int x, y;
-  // Allocate the height of the cumulativeSums matrix for each width index
-  for (x = 0; x < img->width; x++)
+  // Each sum is the sum of the row up to x plus the sum right above it
+  for (int y = 0; y < h; y++)
+  {
+    const uint8 *row = img->pixel + (size_t)y * w;
+    unsigned long *srow = sums + (size_t)y * w;
+    unsigned long rowSum = 0;
+    for (int x = 0; x < w; x++)
+    {
+      rowSum += row[x];
+      srow[x] = y > 0 ? rowSum + srow[x - w] : rowSum;
+    }
+  }
+  INSTR_BULK(ITERATIONS, (unsigned long)w * h);
+  INSTR_BULK(PIXMEM, (unsigned long)w * h); // count pixel memory accesses
+  INSTR_BULK(BYTES, (unsigned long)w * h * (1 + sizeof(unsigned long)));
+  return sums;
+}
+
+// Specialized blur kernels for small radii
+//
+// For dx, dy <= SMALLBLUR, the window sums are small, and computing them
+// directly is faster than the integral image (with 8-byte sums and four
+// reads per pixel from a table of the whole image size):
+// - colsum[x] holds the sum of the pixels of column x in the rows of the
+//   window, updated from one row to the next by adding the row that
+//   enters the window and subtracting the one that leaves it;
+// - each output pixel adds the 2dx+1 column sums of its window.
+// As the image is blurred in-place, the last dy+1 original rows are kept
+// in a ring buffer, to be subtracted when they leave the window.
+//
+// The mean is rounded as in the general version, but in integer
+// arithmetic: (uint8)(s / n + 0.5) == (2s + n) / (2n), exactly.
+// For a full window, n is a constant of the kernel, so the compiler
+// replaces the division by a multiplication.
+//
+// blurSmall is written for any radius, and is instantiated (inlined) with
+// constant radii by BLURKERNEL, so that the loops over the window are
+// unrolled.
+
+#define SMALLBLUR 3
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE static inline
+#endif
+
+// Mean of the column sums of a row of width w in the window of pixel x,
+// [x-dx, x+dx] clipped to the row, with the given number of rows.
+static inline uint8 clippedMean(const uint16_t *colsum, int w, int x, int dx, unsigned rows)
+{
+  int x1 = x - dx > 0 ? x - dx : 0;
+  int x2 = x + dx < w ? x + dx : w - 1;
+  unsigned sum = 0;
+  for (int i = x1; i <= x2; i++)
+    sum += colsum[i];
+  unsigned n = (x2 - x1 + 1) * rows;
+  return (uint8)((2 * sum + n) / (2 * n));
+}
+
+// Blur img with a (2dx+1)x(2dy+1) mean filter, given
+// a buffer ring of (dy+1)*width bytes and colsum of width entries.
+ALWAYS_INLINE void blurSmall(Image img, const int dx, const int dy, uint8 *ring, uint16_t *colsum)
+{
+  int w = img->width;
+  int h = img->height;
+  const unsigned full = (2 * dx + 1) * (2 * dy + 1); // pixels in a full window
+
+  // Column sums of the rows above the first one that enters the window
+  memset(colsum, 0, (size_t)w * sizeof(uint16_t));
+  for (int j = 0; j < dy && j < h; j++)
+  {
+    const uint8 *src = img->pixel + (size_t)j * w;
+    for (int x = 0; x < w; x++)
+      colsum[x] += src[x];
+  }
+
+  for (int y = 0; y < h; y++)
   {
-    ITERATIONS++;
-    cumulativeSums[x] = (unsigned long*)malloc(img->height * sizeof(unsigned long));
-    if (cumulativeSums[x] == NULL)
+    uint8 *row = img->pixel + (size_t)y * w;
+    // Move the window to rows [y-dy, y+dy] (clipped to the image):
+    // add row y+dy, subtract row y-dy-1, which is kept in the ring slot
+    // where row y is saved (in a single pass)
+    uint8 *slot = ring + (size_t)(y % (dy + 1)) * w;
+    const uint8 *src = img->pixel + (size_t)(y + dy) * w;
+    if (y - dy - 1 >= 0 && y + dy < h)
     {
-      errsave = errno;
-      errno = errsave;
-      for (int j = 0; j <= x; j++)
+      for (int x = 0; x < w; x++)
       {
-        free(cumulativeSums[j]);
+        colsum[x] += src[x] - slot[x];
+        slot[x] = row[x];
+      }
+    }
+    else if (y + dy < h)
+    {
+      for (int x = 0; x < w; x++)
+      {
+        colsum[x] += src[x];
+        slot[x] = row[x];
+      }
+    }
+    else
+    {
+      for (int x = 0; x < w; x++)
+      {
+        colsum[x] -= slot[x];
+        slot[x] = row[x];
+      }
+    }
+
+    int y1 = y - dy > 0 ? y - dy : 0;
+    int y2 = y + dy < h ? y + dy : h - 1;
+    unsigned rows = y2 - y1 + 1;
+    // Pixels near the left and right sides have smaller windows
+    for (int x = 0; x < dx; x++)
+      row[x] = clippedMean(colsum, w, x, dx, rows);
+    for (int x = w - dx; x < w; x++)
+      row[x] = clippedMean(colsum, w, x, dx, rows);
+    // Inside of the row: full windows, or windows clipped at the top or bottom
+    if (rows == (unsigned)(2 * dy + 1))
+    {
+      for (int x = dx; x < w - dx; x++)
+      {
+        unsigned sum = 0;
+        for (int i = -dx; i <= dx; i++)
+          sum += colsum[x + i];
+        row[x] = (uint8)((2 * sum + full) / (2 * full));
+      }
+    }
+    else
+    {
+      unsigned n = (2 * dx + 1) * rows;
+      for (int x = dx; x < w - dx; x++)
+      {
+        unsigned sum = 0;
+        for (int i = -dx; i <= dx; i++)
+          sum += colsum[x + i];
+        row[x] = (uint8)((2 * sum + n) / (2 * n));
       }
-      free(cumulativeSums);
-      return NULL;
     }
   }
+}
 
-  //Initialize the first column of the cumulativeSums matrix
-  for (x = 0; x < img->width; x++){
-    ITERATIONS++;
-    if (x == 0) cumulativeSums[x][0] = ImageGetPixel(img, 0, 0); //If it is the first pixel, the sum is the pixel itself
-    else cumulativeSums[x][0] = ImageGetPixel(img, x, 0) + cumulativeSums[x-1][0];
+// Define blurDXxDY(img, ring, colsum), the kernel for radii DX and DY.
+#define BLURKERNEL(DX, DY)                                           \
+  static void blur##DX##x##DY(Image img, uint8 *ring, uint16_t *colsum) \
+  {                                                                  \
+    blurSmall(img, DX, DY, ring, colsum);                            \
   }
 
-  //Initialize the first row of the cumulativeSums matrix
-  for (y = 1; y < img->height; y++){
-    ITERATIONS++;
-    cumulativeSums[0][y] = ImageGetPixel(img, 0, y) + cumulativeSums[0][y-1];
+BLURKERNEL(0, 0)
+BLURKERNEL(1, 0)
+BLURKERNEL(2, 0)
+BLURKERNEL(3, 0)
+BLURKERNEL(0, 1)
+BLURKERNEL(1, 1)
+BLURKERNEL(2, 1)
+BLURKERNEL(3, 1)
+BLURKERNEL(0, 2)
+BLURKERNEL(1, 2)
+BLURKERNEL(2, 2)
+BLURKERNEL(3, 2)
+BLURKERNEL(0, 3)
+BLURKERNEL(1, 3)
+BLURKERNEL(2, 3)
+BLURKERNEL(3, 3)
+
+// The kernels, indexed by [dy][dx]
+static void (*const blurKernels[SMALLBLUR + 1][SMALLBLUR + 1])(Image, uint8 *, uint16_t *) = {
+    {blur0x0, blur1x0, blur2x0, blur3x0},
+    {blur0x1, blur1x1, blur2x1, blur3x1},
+    {blur0x2, blur1x2, blur2x2, blur3x2},
+    {blur0x3, blur1x3, blur2x3, blur3x3},
+};
+
+// Blur img with the specialized kernel for dx, dy <= SMALLBLUR.
+static void blurSmallRadius(Image img, int dx, int dy)
+{
+  int w = img->width;
+  uint8 *ring = malloc((size_t)(dy + 1) * w + 1);
+  uint16_t *colsum = malloc((size_t)w * sizeof(uint16_t) + 1);
+  if (check(ring != NULL && colsum != NULL, "Allocating blur buffers"))
+  {
+    blurKernels[dy][dx](img, ring, colsum);
+    // Iterations and accesses counted as in the integral path
+    // (one pass for the sums and one for the means)
+    INSTR_BULK(ITERATIONS, 2ul * w * img->height);
+    INSTR_BULK(PIXMEM, 2ul * w * img->height); // count pixel memory accesses
+    // The pixels are read, copied to the ring and written
+    COUNTPIXELS((unsigned long)w * img->height, 3ul * w * img->height);
+  } // else: image left unchanged
+  errsave = errno;
+  free(ring);
+  free(colsum);
+  errno = errsave;
+}
+
+// Blur img with running sums (BLUR_SLIDING), for any radius.
+// As blurSmall, but each output pixel is computed from the previous one,
+// adding the column sum that enters the window and subtracting the one
+// that leaves it, so the cost does not depend on dx.
+// The sums are unsigned long, to hold windows of any size.
+static void blurSliding(Image img, int dx, int dy)
+{
+  int w = img->width;
+  int h = img->height;
+  uint8 *ring = malloc((size_t)(dy + 1) * w + 1);
+  unsigned long *colsum = calloc((size_t)w + 1, sizeof(unsigned long));
+  if (!check(ring != NULL && colsum != NULL, "Allocating blur buffers"))
+  {
+    errsave = errno;
+    free(ring);
+    free(colsum);
+    errno = errsave;
+    return; // image left unchanged
+  }
+
+  // Column sums of the rows above the first one that enters the window
+  for (int j = 0; j < dy && j < h; j++)
+  {
+    const uint8 *src = img->pixel + (size_t)j * w;
+    for (int x = 0; x < w; x++)
+      colsum[x] += src[x];
   }
 
-  // Calculate the rest of the cumulativeSums matrix
-  for (x = 1; x < img->width; x++)
+  for (int y = 0; y < h; y++)
   {
-    for (y = 1; y < img->height; y++)
+    uint8 *row = img->pixel + (size_t)y * w;
+    // Move the window to rows [y-dy, y+dy], as in blurSmall
+    uint8 *slot = ring + (size_t)(y % (dy + 1)) * w;
+    if (y + dy < h)
+    {
+      const uint8 *src = img->pixel + (size_t)(y + dy) * w;
+      for (int x = 0; x < w; x++)
+        colsum[x] += src[x];
+    }
+    if (y - dy - 1 >= 0)
     {
-      ITERATIONS++;
-      cumulativeSums[x][y] = ImageGetPixel(img, x, y) + cumulativeSums[x - 1][y] + cumulativeSums[x][y - 1] - cumulativeSums[x - 1][y - 1];
+      for (int x = 0; x < w; x++)
+        colsum[x] -= slot[x];
+    }
+    memcpy(slot, row, (size_t)w);
+
+    int y1 = y - dy > 0 ? y - dy : 0;
+    int y2 = y + dy < h ? y + dy : h - 1;
+    unsigned long rows = y2 - y1 + 1;
+    // Window [x-dx, x+dx], clipped to the row
+    unsigned long sum = 0;
+    for (int x = 0; x < dx && x < w; x++)
+      sum += colsum[x];
+    for (int x = 0; x < w; x++)
+    {
+      if (x + dx < w)
+        sum += colsum[x + dx];
+      if (x - dx - 1 >= 0)
+        sum -= colsum[x - dx - 1];
+      int x1 = x - dx > 0 ? x - dx : 0;
+      int x2 = x + dx < w ? x + dx : w - 1;
+      unsigned long n = (x2 - x1 + 1) * rows;
+      row[x] = (uint8)((2 * sum + n) / (2 * n));
     }
   }
-  return cumulativeSums;
+  // Iterations and accesses counted as in blurSmallRadius
+  INSTR_BULK(ITERATIONS, 2ul * w * h);
+  INSTR_BULK(PIXMEM, 2ul * w * h); // count pixel memory accesses
+  // The pixels are read, copied to the ring and written
+  COUNTPIXELS((unsigned long)w * h, 3ul * w * h);
+  free(ring);
+  free(colsum);
 }
+
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
@@ -773,6 +1832,18 @@ void ImageBlur(Image img, int dx, int dy)
   assert(2*dx+1 <= img->width);  
   assert(2*dy+1 <= img->height); 
 
+  // The strategies have the same result (see ImageStrategy)
+  int dmax = dx > dy ? dx : dy;
+  switch (ImageStrategy(TUNE_BLUR, img->width, img->height, dmax))
+  {
+  case BLUR_SMALL:
+    blurSmallRadius(img, dx, dy);
+    return;
+  case BLUR_SLIDING:
+    blurSliding(img, dx, dy);
+    return;
+  }
+
   // 1º way - O(width*height*(2dx+1)*(2dy+1)) time complexity
   //  Image blurredImg = ImageCreate(img->width, img->height, img->maxval);
   //  if (blurredImg == NULL)
@@ -823,47 +1894,744 @@ void ImageBlur(Image img, int dx, int dy)
   //              3 - Because calculating the mean of the pixels is O(1) time complexity, for all the pixels of the image it is only O(width*height) time complexity
 
   // Calculate the array of the cumulative sums of the pixels
-  unsigned long **cumulativeSums = calculeCumulativeSums(img);
+  unsigned long *sums = integralImage(img);
+  if (sums == NULL)
+  {
+    return; // image left unchanged
+  }
 
   // Calculate the mean of the pixels in the rectangle [x-dx, x+dx]x[y-dy, y+dy]
+  int w = img->width;
+  int h = img->height;
   double sum, mean;
   int window, x, y, x1, x2, y1, y2;
 
-  for (x = 0; x < img->width; x++)
+  for (y = 0; y < h; y++)
   {
-    for (y = 0; y < img->height; y++)
+    //Calculate the rectangle rows, limited to the image
+    y1 = y - dy > 0 ? y - dy : 0;         // y1 is the top side of the rectangle
+    y2 = y + dy < h ? y + dy : h - 1;     // y2 is the bottom side of the rectangle
+    const unsigned long *bottom = sums + (size_t)y2 * w;
+    const unsigned long *top = y1 > 0 ? sums + (size_t)(y1 - 1) * w : NULL; // row above the rectangle
+    uint8 *row = img->pixel + (size_t)y * w;
+    for (x = 0; x < w; x++)
     {
-      ITERATIONS++;
-      //Calculate the rectangle coordinates
-      x1 = x - dx; // x1 is the left side of the rectangle
-      x2 = x + dx; // x2 is the right side of the rectangle
-      y1 = y - dy; // y1 is the top side of the rectangle
-      y2 = y + dy; // y2 is the bottom side of the rectangle
-
-      // Check if the rectangle is inside the image, if not set the rectangle to the image limits
-      if (x1 < 0) x1 = 0;
-      if (x2 >= img->width) x2 = img->width - 1;
-      if (y1 < 0) y1 = 0;
-      if (y2 >= img->height) y2 = img->height - 1;
+      //Calculate the rectangle columns, limited to the image
+      x1 = x - dx > 0 ? x - dx : 0;     // x1 is the left side of the rectangle
+      x2 = x + dx < w ? x + dx : w - 1; // x2 is the right side of the rectangle
 
       //Calculate the sum of the pixels in the rectangle
-      sum = cumulativeSums[x2][y2]; 
-      if (x1 > 0) sum -= cumulativeSums[x1 - 1][y2];
-      if (y1 > 0) sum -= cumulativeSums[x2][y1 - 1];
-      if (x1 > 0 && y1 > 0) sum += cumulativeSums[x1 - 1][y1 - 1];
+      unsigned long s = bottom[x2];
+      if (x1 > 0) s -= bottom[x1 - 1];
+      if (top != NULL) s -= top[x2];
+      if (x1 > 0 && top != NULL) s += top[x1 - 1];
+      sum = s;
 
       // Calculate the mean of the pixels in the rectangle
       window = (x2 - x1 + 1) * (y2 - y1 + 1);
       mean = sum / window + 0.5; // +0.5 so it rounds up
 
       // Set the pixel to the mean
-      ImageSetPixel(img, x, y, (uint8)mean);
+      row[x] = (uint8)mean;
     }
   }
-  //Deallocate the cumulativeSums matrix
-  for (x = 0; x < img->width; x++){
-    ITERATIONS++;
-    free(cumulativeSums[x]);
+  INSTR_BULK(ITERATIONS, (unsigned long)w * h);
+  INSTR_BULK(PIXMEM, (unsigned long)w * h); // count pixel memory accesses
+  // The sums are read from two rows, which are usually in cache
+  COUNTPIXELS((unsigned long)w * h, (unsigned long)w * h * (1 + sizeof(unsigned long)));
+  free(sums);
+}
+
+/// Binary images (bitmaps)
+
+// The data structure
+//
+// A bitmap stores each row in an array of 64-bit words, with the first
+// pixel of the row in the most significant bit of the first word:
+//   pixel (x,y) is bit 63-x%64 of bits[y*words + x/64].
+// This is the order of the pixels in the bytes of a PBM file, so a word
+// holds 8 consecutive bytes of a file row (in big-endian order).
+// The padding bits after the last pixel of a row are always clear, so that
+// whole words may be compared and counted.
+
+// Internal structure for storing bitmaps
+struct bitmap
+{
+  int width;
+  int height;
+  int words;      // words per row
+  uint64_t *bits; // rows of words
+};
+
+#define WORDBITS 64
+
+// The mask of the bits used by pixels in the last word of a row of width w.
+static inline uint64_t lastMask(int w)
+{
+  return w % WORDBITS == 0 ? ~(uint64_t)0 : ~(~(uint64_t)0 >> (w % WORDBITS));
+}
+
+// Number of set bits in a word.
+static inline int popcount64(uint64_t v)
+{
+#if defined(__GNUC__)
+  return __builtin_popcountll(v);
+#else
+  v = v - ((v >> 1) & 0x5555555555555555ULL);
+  v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+  v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return (int)((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/// Create a new bitmap, with all pixels clear.
+Bitmap BitmapCreate(int width, int height)
+{ ///
+  assert(width >= 0);
+  assert(height >= 0);
+  Bitmap bmp = malloc(sizeof(struct bitmap));
+  if (!check(bmp != NULL, "Allocating bitmap"))
+  {
+    return NULL;
+  }
+  bmp->width = width;
+  bmp->height = height;
+  bmp->words = (width + WORDBITS - 1) / WORDBITS;
+  size_t n = (size_t)bmp->words * height;
+  bmp->bits = calloc(n > 0 ? n : 1, sizeof(uint64_t));
+  if (!check(bmp->bits != NULL, "Allocating bits"))
+  {
+    errsave = errno;
+    free(bmp);
+    errno = errsave;
+    return NULL;
+  }
+  return bmp;
+}
+
+/// Destroy the bitmap pointed to by (*bmpp).
+void BitmapDestroy(Bitmap *bmpp)
+{ ///
+  assert(bmpp != NULL);
+  if (*bmpp == NULL)
+    return;
+  errsave = errno;
+  free((*bmpp)->bits);
+  free(*bmpp);
+  *bmpp = NULL;
+  errno = errsave;
+}
+
+/// Get bitmap width
+int BitmapWidth(Bitmap bmp)
+{ ///
+  assert(bmp != NULL);
+  return bmp->width;
+}
+
+/// Get bitmap height
+int BitmapHeight(Bitmap bmp)
+{ ///
+  assert(bmp != NULL);
+  return bmp->height;
+}
+
+/// Get the pixel (0 or 1) at position (x,y).
+int BitmapGetPixel(Bitmap bmp, int x, int y)
+{ ///
+  assert(bmp != NULL);
+  assert(0 <= x && x < bmp->width && 0 <= y && y < bmp->height);
+  INSTR_OP(PIXMEM, 1); // count one pixel access (read)
+  uint64_t word = bmp->bits[(size_t)y * bmp->words + x / WORDBITS];
+  return (int)(word >> (WORDBITS - 1 - x % WORDBITS)) & 1;
+}
+
+/// Set (bit != 0) or clear (bit == 0) the pixel at position (x,y).
+void BitmapSetPixel(Bitmap bmp, int x, int y, int bit)
+{ ///
+  assert(bmp != NULL);
+  assert(0 <= x && x < bmp->width && 0 <= y && y < bmp->height);
+  INSTR_OP(PIXMEM, 1); // count one pixel access (store)
+  uint64_t *word = &bmp->bits[(size_t)y * bmp->words + x / WORDBITS];
+  uint64_t mask = (uint64_t)1 << (WORDBITS - 1 - x % WORDBITS);
+  *word = bit ? *word | mask : *word & ~mask;
+}
+
+/// Count the pixels that are set.
+unsigned long BitmapCount(Bitmap bmp)
+{ ///
+  assert(bmp != NULL);
+  size_t n = (size_t)bmp->words * bmp->height;
+  unsigned long count = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    count += popcount64(bmp->bits[i]);
+  }
+  INSTR_BULK(PIXMEM, n); // count word accesses
+  COUNTPIXELS((unsigned long)bmp->width * bmp->height, n * sizeof(uint64_t));
+  return count;
+}
+
+// Pack a row of w pixels of an image into words of a bitmap row:
+// pixels with level>=thr are set.
+static void packRow(uint64_t *words, const uint8 *row, int w, uint8 thr)
+{
+  int x = 0;
+  for (int k = 0; x < w; k++)
+  {
+    int n = w - x < WORDBITS ? w - x : WORDBITS;
+    uint64_t word = 0;
+    for (int b = 0; b < n; b++)
+    {
+      word = word << 1 | (row[x + b] >= thr);
+    }
+    words[k] = word << (WORDBITS - n); // padding bits are clear
+    x += n;
+  }
+}
+
+/// Threshold an image into a new bitmap.
+Bitmap ImageThresholdToBitmap(Image img, uint8 thr)
+{ ///
+  assert(img != NULL);
+  int w = img->width;
+  int h = img->height;
+  Bitmap bmp = BitmapCreate(w, h);
+  if (bmp == NULL)
+    return NULL;
+  for (int y = 0; y < h; y++)
+  {
+    packRow(bmp->bits + (size_t)y * bmp->words, img->pixel + (size_t)y * w, w, thr);
+  }
+  INSTR_BULK(PIXMEM, (unsigned long)w * h); // count pixel memory accesses
+  COUNTPIXELS((unsigned long)w * h, (unsigned long)w * h + (unsigned long)bmp->words * h * sizeof(uint64_t));
+  return bmp;
+}
+
+/// Convert an image into a new bitmap: nonzero pixels are set.
+Bitmap ImageToBitmap(Image img)
+{ ///
+  return ImageThresholdToBitmap(img, 1);
+}
+
+// Convert a bitmap into a new image in context ctx.
+static Image bitmapToImage(ImageContext ctx, Bitmap bmp, uint8 maxval)
+{
+  assert(bmp != NULL);
+  int w = bmp->width;
+  int h = bmp->height;
+  Image img = imageCreateRaw(ctx, w, h, maxval);
+  if (img == NULL)
+    return NULL;
+  for (int y = 0; y < h; y++)
+  {
+    const uint64_t *words = bmp->bits + (size_t)y * bmp->words;
+    uint8 *row = img->pixel + (size_t)y * w;
+    for (int x = 0; x < w; x++)
+    {
+      row[x] = (words[x / WORDBITS] >> (WORDBITS - 1 - x % WORDBITS)) & 1 ? maxval : 0;
+    }
+  }
+  INSTR_BULK(PIXMEM, (unsigned long)w * h); // count pixel memory accesses
+  COUNTPIXELS((unsigned long)w * h, (unsigned long)w * h + (unsigned long)bmp->words * h * sizeof(uint64_t));
+  return img;
+}
+
+/// Convert a bitmap into a new image.
+Image BitmapToImage(Bitmap bmp, uint8 maxval)
+{ ///
+  return bitmapToImage(NULL, bmp, maxval);
+}
+
+/// PBM file operations
+
+// See also:
+// PBM format specification: http://netpbm.sourceforge.net/doc/pbm.html
+//
+// A row of a raw PBM file has (width+7)/8 bytes, with 1 for black, so the
+// bytes of a file row are the bytes of the bitmap row words (most
+// significant first), inverted.
+
+/// Load a raw PBM (P4) file.
+Bitmap BitmapLoad(const char *filename)
+{ ///
+  int w = 0, h = 0;
+  char c;
+  FILE *f = NULL;
+  Bitmap bmp = NULL;
+  uint8 *row = NULL;
+
+  int success =
+      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      // Parse PBM header
+      check(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format") &&
+      skipComments(f) >= 0 &&
+      check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width") &&
+      skipComments(f) >= 0 &&
+      check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height") &&
+      check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected") &&
+      (bmp = BitmapCreate(w, h)) != NULL &&
+      check((row = malloc(((size_t)bmp->words + 1) * sizeof(uint64_t))) != NULL, "Allocating row");
+  size_t nbytes = (size_t)(w + 7) / 8;
+  for (int y = 0; success && y < h; y++)
+  {
+    success = check(fread(row, 1, nbytes, f) == nbytes, "Reading pixels");
+    uint64_t *words = bmp->bits + (size_t)y * bmp->words;
+    for (int k = 0; success && k < bmp->words; k++)
+    {
+      uint64_t word = 0;
+      for (size_t i = 8 * (size_t)k; i < 8 * (size_t)k + 8; i++)
+      {
+        word = word << 8 | (i < nbytes ? (uint8)~row[i] : 0);
+      }
+      words[k] = word;
+    }
+    if (bmp->words > 0)
+      words[bmp->words - 1] &= lastMask(w);
+  }
+  if (success)
+  {
+    INSTR_BULK(PIXMEM, (unsigned long)bmp->words * h); // count word accesses
+    COUNTPIXELS((unsigned long)w * h, (unsigned long)nbytes * h);
+  }
+
+  // Cleanup
+  errsave = errno;
+  if (!success)
+    BitmapDestroy(&bmp);
+  if (f != NULL)
+    fclose(f);
+  free(row);
+  errno = errsave;
+  return bmp;
+}
+
+/// Save bitmap to a raw PBM (P4) file.
+int BitmapSave(Bitmap bmp, const char *filename)
+{ ///
+  assert(bmp != NULL);
+  int w = bmp->width;
+  int h = bmp->height;
+  size_t nbytes = (size_t)(w + 7) / 8;
+  FILE *f = NULL;
+  uint8 *row = NULL;
+
+  int success =
+      check((row = malloc(((size_t)bmp->words + 1) * sizeof(uint64_t))) != NULL, "Allocating row") &&
+      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
+  for (int y = 0; success && y < h; y++)
+  {
+    const uint64_t *words = bmp->bits + (size_t)y * bmp->words;
+    for (size_t i = 0; i < nbytes; i++)
+    {
+      row[i] = (uint8)~(words[i / 8] >> (56 - 8 * (i % 8)));
+    }
+    if (w % 8 != 0) // padding bits of the last byte are clear
+      row[nbytes - 1] &= (uint8)(0xff << (8 - w % 8));
+    success = check(fwrite(row, 1, nbytes, f) == nbytes, "Writing pixels failed");
+  }
+  INSTR_BULK(PIXMEM, (unsigned long)bmp->words * h); // count word accesses
+  COUNTPIXELS((unsigned long)w * h, (unsigned long)nbytes * h);
+
+  // Cleanup
+  errsave = errno;
+  if (f != NULL)
+    fclose(f);
+  free(row);
+  errno = errsave;
+  return success;
+}
+
+/// Bitmap comparison
+
+// Count the pixels of bmp2 that differ from bmp1 at position (x, y), as
+// BitmapMismatches.
+// Each word of bmp2 is compared with the 64 pixels of bmp1 that start at
+// the same position, which in general span two words of bmp1 (the last
+// bits of one word and the first of the next).
+static int mismatches(Bitmap bmp1, int x, int y, Bitmap bmp2, int limit)
+{
+  int m = bmp2->words;
+  int q = x / WORDBITS; // first word of bmp1 in each row
+  int s = x % WORDBITS; // and the bit where bmp2 starts in it
+  int avail = bmp1->words - q;
+  uint64_t last = lastMask(bmp2->width);
+  int count = 0;
+  unsigned long n = 0; // words compared
+  for (int j = 0; j < bmp2->height && count <= limit; j++)
+  {
+    const uint64_t *row1 = bmp1->bits + (size_t)(y + j) * bmp1->words + q;
+    const uint64_t *row2 = bmp2->bits + (size_t)j * m;
+    for (int k = 0; k < m; k++)
+    {
+      uint64_t window = row1[k];
+      if (s != 0)
+        window = window << s | (k + 1 < avail ? row1[k + 1] >> (WORDBITS - s) : 0);
+      uint64_t diff = (window ^ row2[k]) & (k == m - 1 ? last : ~(uint64_t)0);
+      n++;
+      if (diff != 0 && (count += popcount64(diff)) > limit)
+        break;
+    }
+  }
+  INSTR_BULK(ITERATIONS, n);
+  COUNTPIXELS(n * WORDBITS, 2 * n * sizeof(uint64_t));
+  return count;
+}
+
+/// Compare a bitmap to a subbitmap of a larger bitmap.
+int BitmapMatchSubBitmap(Bitmap bmp1, int x, int y, Bitmap bmp2)
+{ ///
+  return BitmapMismatches(bmp1, x, y, bmp2, 0) == 0;
+}
+
+/// Count the pixels of bmp2 that differ from bmp1 at position (x, y).
+int BitmapMismatches(Bitmap bmp1, int x, int y, Bitmap bmp2, int limit)
+{ ///
+  assert(bmp1 != NULL);
+  assert(bmp2 != NULL);
+  assert(x >= 0 && y >= 0 && x + bmp2->width <= bmp1->width && y + bmp2->height <= bmp1->height);
+  assert(limit >= 0);
+  return mismatches(bmp1, x, y, bmp2, limit);
+}
+
+/// Locate a subbitmap inside another bitmap.
+int BitmapLocateSubBitmap(Bitmap bmp1, int *px, int *py, Bitmap bmp2)
+{ ///
+  return BitmapLocateApprox(bmp1, px, py, bmp2, 0);
+}
+
+/// Locate an approximate match of a subbitmap inside another bitmap.
+int BitmapLocateApprox(Bitmap bmp1, int *px, int *py, Bitmap bmp2, int maxerr)
+{ ///
+  assert(bmp1 != NULL);
+  assert(bmp2 != NULL);
+  assert(maxerr >= 0);
+  for (int x = 0; x <= bmp1->width - bmp2->width; x++)
+  {
+    for (int y = 0; y <= bmp1->height - bmp2->height; y++)
+    {
+      if (mismatches(bmp1, x, y, bmp2, maxerr) <= maxerr)
+      {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/// Strategies and autotuning
+
+// The decision table
+//
+// Each entry gives the fastest strategy measured for an operation on an
+// image of size pixels, with parameter param (see ImageStrategy).
+// A call uses the entry nearest to its own size and param, in ratio (that
+// is, in log scale), among those with a strategy that applies to the call.
+//
+// The table is loaded from the cache file on first use, and replaced by
+// ImageAutotune.  A published table is never changed (ImageAutotune
+// publishes a new one), so ImageStrategy reads it without locking.
+// Lines of the cache file are:
+//   cpu model TAB op TAB size TAB param TAB strategy
+// Only the lines for this CPU model are used, and later lines replace
+// earlier ones for the same op, size and param.
+
+#define MAXTUNE 64
+
+typedef struct
+{
+  ImageTuneOp op;
+  unsigned long size; // pixels of the image
+  int param;
+  int strategy;
+} TuneEntry;
+
+typedef struct tuneTable
+{
+  int count;
+  TuneEntry entry[MAXTUNE];
+  struct tuneTable *prev; // table replaced by this one (kept: it may be in use)
+} TuneTable;
+
+// The published table (NULL until loaded)
+static _Atomic(TuneTable *) tuneTable = NULL;
+// Used if a table cannot be allocated
+static TuneTable emptyTable;
+// Serializes loading and replacing the table
+static pthread_mutex_t tuneLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Strategies set by ImageForceStrategy, per op
+static _Atomic int forced[2] = {STRATEGY_AUTO, STRATEGY_AUTO};
+
+// Strategy being measured by ImageAutotune in this thread, per op
+static _Thread_local int trying[2] = {STRATEGY_AUTO, STRATEGY_AUTO};
+
+static const char *const opNames[2] = {"blur", "locate"};
+static const char *const blurNames[] = {"integral", "sliding", "small"};
+static const char *const locateNames[] = {"pixels", "rows"};
+static const char *const *const strategyNames[2] = {blurNames, locateNames};
+static const int numStrategies[2] = {3, 2};
+
+// Check if strategy applies to a call of op with parameter param.
+static int applies(ImageTuneOp op, int strategy, int param)
+{
+  if (strategy < 0 || strategy >= numStrategies[op])
+    return 0;
+  return op != TUNE_BLUR || strategy != BLUR_SMALL || param <= SMALLBLUR;
+}
+
+// Index of name in names[0..n-1], or -1.
+static int nameIndex(const char *const *names, int n, const char *name)
+{
+  for (int i = 0; i < n; i++)
+  {
+    if (strcmp(names[i], name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Add an entry to table t (not yet published), or replace the one with
+// the same op, size and param.
+static void addTuneEntry(TuneTable *t, ImageTuneOp op, unsigned long size, int param, int strategy)
+{
+  int i = 0;
+  while (i < t->count && !(t->entry[i].op == op && t->entry[i].size == size && t->entry[i].param == param))
+    i++;
+  if (i == MAXTUNE)
+    return; // table full: ignored
+  t->entry[i] = (TuneEntry){op, size, param, strategy};
+  if (i == t->count)
+    t->count++;
+}
+
+// Load a decision table from the cache file (empty if there is none).
+// errno is preserved.
+static TuneTable *loadTuneTable(void)
+{
+  char path[1024], model[256], line[512];
+  errsave = errno;
+  TuneTable *t = calloc(1, sizeof(*t));
+  if (t == NULL)
+    t = &emptyTable;
+  FILE *f = NULL;
+  if (t != &emptyTable && InstrCachePath("image8bit-tune", "IMAGE8BIT_TUNE", path, sizeof(path)))
+    f = fopen(path, "r");
+  if (f != NULL)
+  {
+    InstrCpuModel(model, sizeof(model));
+    size_t len = strlen(model);
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+      char opName[16], name[16];
+      unsigned long size;
+      int param;
+      if (strncmp(line, model, len) != 0 || line[len] != '\t' ||
+          sscanf(line + len + 1, "%15s %lu %d %15s", opName, &size, &param, name) != 4)
+        continue;
+      int op = nameIndex(opNames, 2, opName);
+      int strategy = op < 0 ? -1 : nameIndex(strategyNames[op], numStrategies[op], name);
+      if (strategy >= 0)
+        addTuneEntry(t, (ImageTuneOp)op, size, param, strategy);
+    }
+    fclose(f);
+  }
+  errno = errsave;
+  return t;
+}
+
+// The published decision table, loaded on first use.
+static const TuneTable *currentTuneTable(void)
+{
+  TuneTable *t = atomic_load_explicit(&tuneTable, memory_order_acquire);
+  if (t == NULL)
+  {
+    pthread_mutex_lock(&tuneLock);
+    t = atomic_load_explicit(&tuneTable, memory_order_relaxed);
+    if (t == NULL)
+    {
+      t = loadTuneTable();
+      atomic_store_explicit(&tuneTable, t, memory_order_release);
+    }
+    pthread_mutex_unlock(&tuneLock);
+  }
+  return t;
+}
+
+// Ratio between a and b (>= 1).
+static double ratio(double a, double b)
+{
+  return a > b ? a / b : b / a;
+}
+
+/// Force all later calls of op to use strategy.
+void ImageForceStrategy(ImageTuneOp op, int strategy)
+{ ///
+  assert(op == TUNE_BLUR || op == TUNE_LOCATE);
+  assert(strategy == STRATEGY_AUTO || (strategy >= 0 && strategy < numStrategies[op]));
+  atomic_store_explicit(&forced[op], strategy, memory_order_relaxed);
+}
+
+/// Get the strategy that op uses on an image of width x height.
+int ImageStrategy(ImageTuneOp op, int width, int height, int param)
+{ ///
+  assert(op == TUNE_BLUR || op == TUNE_LOCATE);
+  if (applies(op, trying[op], param))
+    return trying[op];
+  int strategy = atomic_load_explicit(&forced[op], memory_order_relaxed);
+  if (applies(op, strategy, param))
+    return strategy;
+
+  const TuneTable *t = currentTuneTable();
+  double size = (double)width * height + 1;
+  double best = 0.0;
+  strategy = STRATEGY_AUTO;
+  for (int i = 0; i < t->count; i++)
+  {
+    const TuneEntry *e = &t->entry[i];
+    if (e->op != op || !applies(op, e->strategy, param))
+      continue;
+    double d = ratio(size, e->size + 1.0) * ratio(param + 1.0, e->param + 1.0);
+    if (strategy == STRATEGY_AUTO || d < best)
+    {
+      best = d;
+      strategy = e->strategy;
+    }
+  }
+  if (strategy != STRATEGY_AUTO)
+    return strategy;
+
+  // No table: small radii have specialized kernels (counted as the
+  // integral path).  Subimages are compared pixel by pixel, as
+  // ImageMatchSubImage, which keeps its column-major counts.
+  if (op == TUNE_BLUR)
+    return param <= SMALLBLUR ? BLUR_SMALL : BLUR_INTEGRAL;
+  return LOCATE_PIXELS;
+}
+
+/// Get the name of strategy of op.
+const char *ImageStrategyName(ImageTuneOp op, int strategy)
+{ ///
+  assert(op == TUNE_BLUR || op == TUNE_LOCATE);
+  if (strategy == STRATEGY_AUTO)
+    return "auto";
+  assert(strategy >= 0 && strategy < numStrategies[op]);
+  return strategyNames[op][strategy];
+}
+
+// Times of each try of a strategy in ImageAutotune (the best is used)
+#define TUNEREPS 3
+
+// Measure all strategies of op that apply to param, on img (and img2,
+// for TUNE_LOCATE), and add the fastest to found[*n].
+static void tuneShape(ImageTuneOp op, Image img, Image img2, int param,
+                      TuneEntry *found, int *n, int verbose)
+{
+  double bestTime = 0.0;
+  int best = 0;
+  if (verbose)
+    printf("%-6s %5dx%-5d %6d ", opNames[op], img->width, img->height, param);
+  for (int s = 0; s < numStrategies[op]; s++)
+  {
+    if (!applies(op, s, param))
+      continue;
+    trying[op] = s;
+    double t = 0.0;
+    for (int k = 0; k < TUNEREPS; k++)
+    {
+      int x, y;
+      double t0 = wall_time();
+      if (op == TUNE_BLUR)
+        ImageBlur(img, param, param);
+      else
+        ImageLocateSubImage(img, &x, &y, img2);
+      double t1 = wall_time() - t0;
+      if (k == 0 || t1 < t)
+        t = t1;
+    }
+    if (verbose)
+      printf("  %s %.3fms", strategyNames[op][s], t * 1e3);
+    if (s == 0 || t < bestTime)
+    {
+      bestTime = t;
+      best = s;
+    }
+  }
+  trying[op] = STRATEGY_AUTO;
+  if (verbose)
+    printf("  -> %s\n", strategyNames[op][best]);
+  found[(*n)++] = (TuneEntry){op, (unsigned long)img->width * img->height, param, best};
+}
+
+/// Measure the time of every strategy and use the fastest.
+int ImageAutotune(int verbose)
+{ ///
+  static const int blurSizes[] = {256, 1024, 2048};
+  static const int blurRadii[] = {1, 2, 3, 5, 10, 30};
+  static const int locateSizes[] = {256, 1024};
+  static const int tmplSizes[] = {4, 16, 64};
+  TuneEntry found[MAXTUNE];
+  int n = 0;
+
+  for (int i = 0; i < 3; i++)
+  {
+    Image img = ImageSynthetic(blurSizes[i], blurSizes[i], SYNTH_NOISE, 1);
+    if (img == NULL)
+      return 0;
+    for (int j = 0; j < 6; j++)
+      tuneShape(TUNE_BLUR, img, NULL, blurRadii[j], found, &n, verbose);
+    ImageDestroy(&img);
+  }
+  for (int i = 0; i < 2; i++)
+  {
+    int size = locateSizes[i];
+    Image img = ImageSynthetic(size, size, SYNTH_NOISE, 1);
+    for (int j = 0; j < 3 && img != NULL; j++)
+    { // The subimage is at the last position tried, so all are tried
+      int t = tmplSizes[j];
+      Image img2 = ImageSyntheticTemplate(t, t, SYNTH_NOISE, 2);
+      if (img2 == NULL)
+        ImageDestroy(&img);
+      else
+      {
+        ImagePaste(img, size - t, size - t, img2);
+        tuneShape(TUNE_LOCATE, img, img2, t * t, found, &n, verbose);
+        ImageDestroy(&img2);
+      }
+    }
+    if (img == NULL)
+      return 0;
+    ImageDestroy(&img);
+  }
+
+  // Publish a copy of the current table, with the entries found
+  currentTuneTable();
+  TuneTable *t = malloc(sizeof(*t));
+  if (!check(t != NULL, "Allocating decision table"))
+    return 0;
+  pthread_mutex_lock(&tuneLock);
+  TuneTable *old = atomic_load_explicit(&tuneTable, memory_order_relaxed);
+  *t = *old;
+  t->prev = old;
+  for (int i = 0; i < n; i++)
+    addTuneEntry(t, found[i].op, found[i].size, found[i].param, found[i].strategy);
+  atomic_store_explicit(&tuneTable, t, memory_order_release);
+  pthread_mutex_unlock(&tuneLock);
+
+  char path[1024], model[256];
+  if (!InstrCachePath("image8bit-tune", "IMAGE8BIT_TUNE", path, sizeof(path)))
+    return 1; // no cache file
+  FILE *f = InstrCacheAppend(path);
+  if (!check(f != NULL, "Opening autotune cache file"))
+    return 0;
+  InstrCpuModel(model, sizeof(model));
+  for (int i = 0; i < n; i++)
+  {
+    fprintf(f, "%s\t%s\t%lu\t%d\t%s\n", model, opNames[found[i].op], found[i].size,
+            found[i].param, strategyNames[found[i].op][found[i].strategy]);
   }
-  free(cumulativeSums);
+  return check(fclose(f) == 0, "Writing autotune cache file");
 }
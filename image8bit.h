@@ -14,6 +14,11 @@
 
 #include <inttypes.h>
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 // Type for pixel levels
 typedef uint8_t uint8;
 
@@ -23,6 +28,9 @@ extern const uint8 PixMax;
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Type ImageContext is a pointer to context objects (see Contexts)
+typedef struct imageContext *ImageContext;
+
 /// Error handling functions
 
 /// Error cause.
@@ -33,10 +41,12 @@ typedef struct image *Image;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// Like errno, the error cause is kept per thread.
 char *ImageErrMsg();
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply request calibration of instrumentation
+/// (done on first InstrPrint) and set names of counters.
 void ImageInit(void);
 
 /// Image management functions
@@ -51,6 +61,11 @@ void ImageInit(void);
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCreate(int width, int height, uint8 maxval);
 
+/// Create a new image with undefined pixel levels.
+/// Same as ImageCreate, but without clearing the pixels, which would be a
+/// wasted pass over the image when the caller writes every pixel anyway.
+Image ImageCreateUninit(int width, int height, uint8 maxval);
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -58,21 +73,128 @@ Image ImageCreate(int width, int height, uint8 maxval);
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image *imgp);
 
+/// Pixel buffer pool
+
+/// Pixel buffers released by ImageDestroy are kept in a pool and reused by
+/// later image creations of a compatible size.  This avoids repeated
+/// allocations (and page faults) in loops that process many images.
+
+/// Pool statistics.
+/// Sets (*hits) to the number of pixel buffers reused from the pool and
+/// (*misses) to the number of buffers that had to be allocated.
+void ImagePoolStats(unsigned long *hits, unsigned long *misses);
+
+/// Enable (nonzero) or disable (0) huge page advice for large buffers.
+/// Only effective on Linux.  Enabled by default.
+void ImagePoolHugePages(int enable);
+
+/// Release all pixel buffers kept in the pool.
+/// May be called at any time, namely before the program ends.
+void ImagePoolRelease(void);
+
+/// Contexts
+
+/// A context holds the state of an independent job, so that jobs running
+/// in different threads of a program do not share it: currently, its own
+/// pool of pixel buffers (which is released with the context).
+/// Images created in a context (with ImageCreateCtx or ImageLoadCtx)
+/// belong to it, and so do the images computed from them by the other
+/// functions (ImageRotate, ImageCrop, ...).  ImageDestroy returns their
+/// pixel buffers to the pool of their context.
+/// Images created by the functions without Ctx belong to no context, and
+/// share the pool of the program (see above).
+///
+/// The other state of the module is already per thread: the error cause
+/// (ImageErrMsg), and the instrumentation counters (InstrCount).
+/// The pool of a context is protected by its own mutex, but it is meant
+/// for a job in a single thread, so that it is never contended.
+
+/// Create a new context.
+/// On success, a new context is returned.
+/// (The caller is responsible for destroying the returned context!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageContext ImageContextCreate(void);
+
+/// Destroy the context pointed to by (*ctxp), and release its pool.
+/// If (*ctxp)==NULL, no operation is performed.
+/// Requires: all images of the context have been destroyed.
+/// Ensures: (*ctxp)==NULL.
+void ImageContextDestroy(ImageContext *ctxp);
+
+/// Pool statistics of context ctx (as ImagePoolStats).
+/// ctx == NULL gives the statistics of the pool of the program.
+void ImageContextPoolStats(ImageContext ctx, unsigned long *hits, unsigned long *misses);
+
+/// Get the context of img (NULL if none).
+ImageContext ImageGetContext(Image img);
+
+/// Create a new black image in context ctx, as ImageCreate.
+/// ctx may be NULL (no context).
+Image ImageCreateCtx(ImageContext ctx, int width, int height, uint8 maxval);
+
+/// Create a new image with undefined pixel levels in context ctx,
+/// as ImageCreateUninit.
+Image ImageCreateUninitCtx(ImageContext ctx, int width, int height, uint8 maxval);
+
 /// PGM file operations
 
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
+/// Raw PBM files are accepted too, as images with maxval PixMax
+/// (see BitmapToImage).
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char *filename);
 
+/// Load a raw PGM (or PBM) file into a new image in context ctx,
+/// as ImageLoad.  ctx may be NULL (no context).
+Image ImageLoadCtx(ImageContext ctx, const char *filename);
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char *filename);
 
+/// Synthetic images
+
+/// Reproducible images for tests and benchmarks, that need no image files.
+/// Pixel levels are a function of the seed and the pixel position only,
+/// so the same arguments always give the same image, on any machine.
+
+/// Content models
+typedef enum
+{
+  SYNTH_NOISE,     // uniformly random levels (incompressible, no structure)
+  SYNTH_GRADIENT,  // smooth diagonal gradient, with a little noise
+  SYNTH_BLOCKS,    // 16x16 blocks of 4 possible levels (low entropy)
+  SYNTH_NEARMATCH, // black: every position nearly matches the template
+} ImageSynthModel;
+
+/// Create a synthetic image with maxval PixMax.
+/// Success and failure are treated as in ImageCreate.
+Image ImageSynthetic(int width, int height, ImageSynthModel model, unsigned long seed);
+
+/// Create a template to embed in synthetic images of the given model
+/// (with ImagePaste), to be found by ImageLocateSubImage.
+/// For SYNTH_NEARMATCH, the template is black except for its last pixel,
+/// so that a search in a SYNTH_NEARMATCH image compares every pixel of the
+/// template at every position but the one where it is embedded (the worst
+/// case for ImageLocateSubImage).  For other models, it is random noise.
+/// Success and failure are treated as in ImageCreate.
+Image ImageSyntheticTemplate(int width, int height, ImageSynthModel model, unsigned long seed);
+
+/// Save a synthetic image to a PGM file, one row at a time, without
+/// creating it in memory (so it may be larger than memory).
+/// If tmpl != NULL, it is embedded at position (x, y), as with ImagePaste.
+/// The file is the same as saving the result of ImageSynthetic (and
+/// ImagePaste).
+/// Requires: tmpl, if given, must fit inside the image at (x, y).
+/// Success and failure are treated as in ImageSave.
+int ImageSaveSynthetic(const char *filename, int width, int height, ImageSynthModel model,
+                       unsigned long seed, Image tmpl, int x, int y);
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -112,6 +234,40 @@ uint8 ImageGetPixel(Image img, int x, int y);
 /// Set the pixel at position (x,y) to new level.
 void ImageSetPixel(Image img, int x, int y, uint8 level);
 
+/// Bulk pixel access
+
+/// These access many pixels per call, without a function call, assertions
+/// and index computation per pixel, so that client code may process pixels
+/// in tight loops (that the compiler may vectorize).
+/// The pixels of a row are contiguous: x = 0 to width-1.
+
+/// Get a pointer to the first pixel of row y (to read only).
+/// The pointer is valid until the image is destroyed.
+/// Requires: 0 <= y < height.
+/// Accesses through the pointer are not counted by instrumentation.
+const uint8 *ImageRowPtr(Image img, int y);
+
+/// Get a pointer to the first pixel of row y (to read and write).
+/// As ImageRowPtr.
+uint8 *ImageMutableRowPtr(Image img, int y);
+
+/// Copy n pixels of row y, from position (x,y), to buf[0..n-1].
+/// Requires: the n pixels must be inside img.
+void ImageGetRow(Image img, int y, int x, int n, uint8 *buf);
+
+/// Copy buf[0..n-1] to n pixels of row y, from position (x,y).
+/// Requires: the n pixels must be inside img.
+void ImageSetRow(Image img, int y, int x, int n, const uint8 *buf);
+
+/// Gather the pixels at n positions (xs[i],ys[i]) into buf[0..n-1].
+/// Requires: all positions must be inside img.
+void ImageGather(Image img, int n, const int *xs, const int *ys, uint8 *buf);
+
+/// Scatter buf[0..n-1] to the pixels at n positions (xs[i],ys[i]).
+/// If a position appears more than once, the last one wins.
+/// Requires: all positions must be inside img.
+void ImageScatter(Image img, int n, const int *xs, const int *ys, const uint8 *buf);
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
@@ -135,6 +291,13 @@ void ImageThreshold(Image img, uint8 thr);
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor);
 
+/// Map pixel levels through a lookup table.
+/// Replace each pixel level v by table[v].
+/// table must have 256 entries (one per possible level).
+/// Any sequence of the transformations above is equivalent to a single
+/// table lookup, so this may be used to apply them all in one pass.
+void ImageMapLevels(Image img, const uint8 *table);
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -145,6 +308,38 @@ void ImageBrighten(Image img, double factor);
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 
+/// Orientations of an image: the 8 elements of the dihedral group D4.
+/// Rotations are anti-clockwise, like ImageRotate.
+typedef enum
+{
+  ORIENT_IDENTITY,     // unchanged
+  ORIENT_ROT90,        // rotated 90 degrees (same as ImageRotate)
+  ORIENT_ROT180,       // rotated 180 degrees
+  ORIENT_ROT270,       // rotated 270 degrees (= 90 degrees clockwise)
+  ORIENT_FLIPX,        // flipped left-right (same as ImageMirror)
+  ORIENT_FLIPY,        // flipped top-bottom
+  ORIENT_TRANSPOSE,    // flipped about the main diagonal: (x,y) -> (y,x)
+  ORIENT_ANTITRANSPOSE // flipped about the other diagonal
+} ImageOrientation;
+
+/// Compose two orientations.
+/// Returns the orientation equivalent to applying first, then second.
+ImageOrientation ImageOrientationCompose(ImageOrientation first, ImageOrientation second);
+
+/// Check if orientation o swaps the image axes.
+/// (The transformed image then has width and height exchanged.)
+int ImageOrientationSwapsAxes(ImageOrientation o);
+
+/// Transform an image.
+/// Returns a version of img transformed according to orientation o,
+/// in a single pass over the pixels.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageTransform(Image img, ImageOrientation o);
+
 /// Rotate an image.
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees anti-clockwise.
@@ -178,6 +373,47 @@ Image ImageMirror(Image img);
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h);
 
+/// Destination-passing variants
+
+/// These functions write the result of a geometric transformation into an
+/// existing image dst, provided by the caller with the right size.
+/// They never fail and involve no allocation, so a loop that transforms
+/// many images of the same size may reuse a single destination image.
+/// dst must be distinct from src; its maxval is set to src maxval.
+
+/// Rotate src 90 degrees anti-clockwise into dst.
+/// Requires: dst width == src height, dst height == src width.
+void ImageRotateInto(Image dst, Image src);
+
+/// Mirror (flip left-right) src into dst.
+/// Requires: dst and src have the same size.
+void ImageMirrorInto(Image dst, Image src);
+
+/// Crop the rectangle of src at (x, y) with the size of dst into dst.
+/// Requires: The rectangle (x, y, dst width, dst height) must be inside src.
+void ImageCropInto(Image dst, Image src, int x, int y);
+
+/// Transform src according to orientation o into dst.
+/// Requires: dst has the size of src, with width and height exchanged
+///   if ImageOrientationSwapsAxes(o).
+void ImageTransformInto(Image dst, Image src, ImageOrientation o);
+
+/// In-place rotations
+
+/// These functions rotate an image in-place: no allocation involved.
+/// They never fail, and are useful when memory is tight.
+
+/// Rotate a square image 90 degrees anti-clockwise (same as ImageRotate).
+/// Requires: img width == img height.
+void ImageRotateInPlace(Image img);
+
+/// Rotate a square image 90 degrees clockwise.
+/// Requires: img width == img height.
+void ImageRotateClockwiseInPlace(Image img);
+
+/// Rotate an image 180 degrees.  Works for any image size.
+void ImageRotate180(Image img);
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -213,4 +449,165 @@ int ImageLocateSubImage(Image img1, int *px, int *py, Image img2);
 /// The image is changed in-place.
 void ImageBlur(Image img, int dx, int dy);
 
+/// Strategies and autotuning
+
+/// ImageBlur and ImageLocateSubImage have several algorithms (strategies),
+/// all with the same results.  Which one is fastest depends on the image
+/// size, the radius or template size, and the machine, so each call
+/// chooses one from a decision table measured on this machine by
+/// ImageAutotune, if there is one, or else by built-in rules (without a
+/// table, ImageLocateSubImage compares pixel by pixel).
+/// All strategies of ImageBlur count the same iterations and pixel
+/// accesses; only the bytes moved differ.
+///
+/// The decision table is kept in a cache file: $IMAGE8BIT_TUNE, or
+/// $XDG_CACHE_HOME/image8bit-tune, or $HOME/.cache/image8bit-tune
+/// (set IMAGE8BIT_TUNE= (empty) to disable it), and is loaded on first use.
+
+/// Operations with several strategies
+typedef enum
+{
+  TUNE_BLUR,   // ImageBlur
+  TUNE_LOCATE, // ImageLocateSubImage
+} ImageTuneOp;
+
+/// Strategies of ImageBlur
+typedef enum
+{
+  BLUR_INTEGRAL, // integral image: four sums per pixel, for any radius
+  BLUR_SLIDING,  // running column and row sums: no table of the image size
+  BLUR_SMALL,    // kernels specialized for dx, dy <= 3 (only for those)
+} ImageBlurStrategy;
+
+/// Strategies of ImageLocateSubImage
+typedef enum
+{
+  LOCATE_PIXELS, // compare pixel by pixel, with ImageMatchSubImage
+  LOCATE_ROWS,   // compare whole rows of pixels (with memcmp)
+} ImageLocateStrategy;
+
+/// Choose the strategy automatically (the default)
+#define STRATEGY_AUTO (-1)
+
+/// Force all later calls of op, in all threads, to use strategy
+/// (or to choose it automatically, with STRATEGY_AUTO).
+/// A forced strategy is ignored in calls where it does not apply.
+void ImageForceStrategy(ImageTuneOp op, int strategy);
+
+/// Get the strategy that op uses on an image of width x height, where
+/// param is max(dx, dy) for TUNE_BLUR, or the number of pixels of the
+/// subimage for TUNE_LOCATE.
+int ImageStrategy(ImageTuneOp op, int width, int height, int param);
+
+/// Get the name of strategy of op (for messages).
+const char *ImageStrategyName(ImageTuneOp op, int strategy);
+
+/// Measure the time of every strategy on a grid of image sizes and radii
+/// (or subimage sizes), choose the fastest for each, and use the result
+/// as the decision table.  Takes some seconds.
+/// If verbose, prints the times and choices to stdout.
+/// The table is added to the cache file, for later programs.
+/// Returns 0 if it could not be saved (errno/errCause are set accordingly),
+/// but it is still used by this program.
+int ImageAutotune(int verbose);
+
+/// Binary images (bitmaps)
+
+/// A bitmap is a binary image packed with 1 bit per pixel (64 pixels per
+/// word), so it takes 8 times less memory than an Image, and operations on
+/// it read 8 times less.  A set pixel (1) corresponds to an Image pixel
+/// at maxval (white), a clear pixel (0) to black, as in the result of
+/// ImageThreshold.
+/// Creation, loading and saving behave as for Image.
+
+/// Bitmap type (opaque, as Image)
+typedef struct bitmap *Bitmap;
+
+/// Create a new bitmap, with all pixels clear.
+/// Requires: width and height must be non-negative.
+/// Success and failure are treated as in ImageCreate.
+Bitmap BitmapCreate(int width, int height);
+
+/// Destroy the bitmap pointed to by (*bmpp), as ImageDestroy.
+void BitmapDestroy(Bitmap *bmpp);
+
+/// Get bitmap width
+int BitmapWidth(Bitmap bmp);
+
+/// Get bitmap height
+int BitmapHeight(Bitmap bmp);
+
+/// Get the pixel (0 or 1) at position (x,y).
+/// Requires: (x,y) inside the bitmap.
+int BitmapGetPixel(Bitmap bmp, int x, int y);
+
+/// Set (bit != 0) or clear (bit == 0) the pixel at position (x,y).
+/// Requires: (x,y) inside the bitmap.
+void BitmapSetPixel(Bitmap bmp, int x, int y, int bit);
+
+/// Count the pixels that are set.
+unsigned long BitmapCount(Bitmap bmp);
+
+/// Threshold an image into a new bitmap.
+/// Pixels with level>=thr are set, others are clear, so the result is
+/// the same as ImageToBitmap after ImageThreshold (but img is not modified).
+/// Success and failure are treated as in ImageCreate.
+Bitmap ImageThresholdToBitmap(Image img, uint8 thr);
+
+/// Convert an image into a new bitmap: nonzero pixels are set.
+/// For images with only 0 and maxval (such as the result of ImageThreshold)
+/// the conversion is lossless.
+/// Success and failure are treated as in ImageCreate.
+Bitmap ImageToBitmap(Image img);
+
+/// Convert a bitmap into a new image: set pixels become maxval (white),
+/// clear pixels become 0 (black).
+/// Requires: maxval > 0.
+/// Success and failure are treated as in ImageCreate.
+Image BitmapToImage(Bitmap bmp, uint8 maxval);
+
+/// Load a raw PBM (P4) file.
+/// In PBM files 1 is black, so file bits are inverted: black pixels are
+/// clear in the bitmap.
+/// Success and failure are treated as in ImageLoad.
+Bitmap BitmapLoad(const char *filename);
+
+/// Save bitmap to a raw PBM (P4) file.
+/// Success and failure are treated as in ImageSave.
+int BitmapSave(Bitmap bmp, const char *filename);
+
+/// Bitmap comparison
+
+/// These compare 64 pixels per operation (XOR of words, with shifts to
+/// align the words of bmp2 to any x position in bmp1), so they are much
+/// faster than the Image versions on binary images.
+
+/// Compare a bitmap to a subbitmap of a larger bitmap.
+/// Returns 1 (true) if bmp2 matches bmp1 at position (x, y), 0 otherwise.
+/// Requires: bmp2 must fit inside bmp1 at position (x, y).
+int BitmapMatchSubBitmap(Bitmap bmp1, int x, int y, Bitmap bmp2);
+
+/// Count the pixels of bmp2 that differ from bmp1 at position (x, y),
+/// but stop counting when there are more than limit: in that case, the
+/// result is some number larger than limit.
+/// Requires: bmp2 must fit inside bmp1 at position (x, y), limit >= 0.
+int BitmapMismatches(Bitmap bmp1, int x, int y, Bitmap bmp2, int limit);
+
+/// Locate a subbitmap inside another bitmap.
+/// Searches for bmp2 inside bmp1, in the same order as ImageLocateSubImage
+/// (so the result is the same as for the corresponding images).
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int BitmapLocateSubBitmap(Bitmap bmp1, int *px, int *py, Bitmap bmp2);
+
+/// Locate an approximate match of a subbitmap inside another bitmap.
+/// As BitmapLocateSubBitmap, but positions where at most maxerr pixels
+/// differ also match (maxerr == 0 is an exact search).
+/// Requires: maxerr >= 0.
+int BitmapLocateApprox(Bitmap bmp1, int *px, int *py, Bitmap bmp2, int maxerr);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,365 @@
+/// image8bit.hpp - C++ interface to the image8bit module (header-only).
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// Requires C++17.  It only uses the functions declared in image8bit.h,
+/// so the C API and ABI are unchanged; link with image8bit.o as usual.
+///
+/// img8::Image owns a C Image and destroys it when it goes out of scope.
+/// It may be moved, but not copied (use clone() for an explicit copy), so
+/// an image is never destroyed twice, nor leaked.
+/// Functions that fail in the C API (returning NULL or 0) throw img8::Error
+/// here, with the message of ImageErrMsg() and the errno value.
+///
+/// The pointwise operations (neg, thr, bri) form expression templates:
+///
+///   img8::Image out = img | img8::neg() | img8::thr(128) | img8::bri(.33);
+///   img |= img8::neg() | img8::thr(128);   // in-place
+///
+/// An expression only records the operations, and their composition is a
+/// single inline function.  When the expression is assigned, that function
+/// is applied to all pixels in one loop over each row (which the compiler
+/// may vectorize), instead of one pass over the image per operation.
+/// The results are the same as with ImageNegative, ImageThreshold and
+/// ImageBrighten, applied in the same order.
+/// Like ImageRowPtr, these loops are not counted by instrumentation.
+///
+/// An expression refers to its source image, so assign it before the
+/// source is destroyed (do not keep it in an auto variable).
+
+#ifndef IMAGE8BIT_HPP
+#define IMAGE8BIT_HPP
+
+#include "image8bit.h"
+
+#include <cassert>
+#include <cerrno>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace img8
+{
+
+/// Error thrown when an image8bit function fails.
+class Error : public std::runtime_error
+{
+public:
+  /// what: the operation that failed (ImageErrMsg() is appended).
+  explicit Error(const std::string &what)
+      : std::runtime_error(what + ": " + cause()), code(errno)
+  {
+  }
+
+  /// errno when the operation failed (0 if it was not set).
+  int code;
+
+private:
+  static std::string cause()
+  {
+    const char *msg = ImageErrMsg();
+    return msg != nullptr ? msg : "unknown error";
+  }
+};
+
+/// A context (see ImageContext), owned by this object.
+/// Destroy it only after all its images (declare it before them).
+class Context
+{
+public:
+  /// Create a new context, as ImageContextCreate.
+  Context() : ctx_(ImageContextCreate())
+  {
+    if (ctx_ == nullptr)
+      throw Error("ImageContextCreate");
+  }
+
+  Context(const Context &) = delete;
+  Context &operator=(const Context &) = delete;
+
+  Context(Context &&other) noexcept : ctx_(std::exchange(other.ctx_, nullptr)) {}
+
+  ~Context() { ImageContextDestroy(&ctx_); }
+
+  /// The C context, still owned by this object.
+  ImageContext get() const noexcept { return ctx_; }
+  operator ImageContext() const noexcept { return ctx_; }
+
+private:
+  ImageContext ctx_;
+};
+
+/// Pointwise operations
+
+/// Each maps the level v of a pixel of an image with the given maxval to
+/// its new level.
+
+/// Negative, as ImageNegative.
+struct neg
+{
+  uint8 operator()(uint8 v, int) const { return (uint8)(255 - v); }
+};
+
+/// Threshold, as ImageThreshold.
+struct thr
+{
+  uint8 level;
+  explicit thr(uint8 level) : level(level) {}
+  uint8 operator()(uint8 v, int maxval) const { return v < level ? 0 : (uint8)maxval; }
+};
+
+/// Brighten by a factor, as ImageBrighten.
+/// Requires: factor >= 0.0.
+struct bri
+{
+  double factor;
+  explicit bri(double factor) : factor(factor) { assert(factor >= 0.0); }
+  uint8 operator()(uint8 v, int maxval) const
+  {
+    double level = v * factor + 0.5;
+    return (uint8)(level > maxval ? maxval : level);
+  }
+};
+
+/// Composition of pointwise operations: first, then second.
+template <class First, class Second>
+struct Compose
+{
+  First first;
+  Second second;
+  uint8 operator()(uint8 v, int maxval) const { return second(first(v, maxval), maxval); }
+};
+
+/// Check if Op is a pointwise operation.
+template <class Op>
+struct IsPointwise : std::false_type
+{
+};
+template <>
+struct IsPointwise<neg> : std::true_type
+{
+};
+template <>
+struct IsPointwise<thr> : std::true_type
+{
+};
+template <>
+struct IsPointwise<bri> : std::true_type
+{
+};
+template <class First, class Second>
+struct IsPointwise<Compose<First, Second>> : std::true_type
+{
+};
+
+template <class Op>
+using EnableIfPointwise = std::enable_if_t<IsPointwise<Op>::value, int>;
+
+/// Compose two pointwise operations: a | b applies a, then b.
+template <class A, class B, EnableIfPointwise<A> = 0, EnableIfPointwise<B> = 0>
+Compose<A, B> operator|(A a, B b)
+{
+  return {a, b};
+}
+
+class Image;
+
+/// Expression: pointwise operation op applied to image src.
+template <class Op>
+struct Pointwise
+{
+  const Image &src;
+  Op op;
+};
+
+/// Images
+
+/// An image, owned by this object.
+class Image
+{
+public:
+  /// An empty object (no image).
+  Image() noexcept = default;
+
+  /// Take ownership of img (which may be NULL).
+  explicit Image(::Image img) noexcept : img_(img) {}
+
+  /// Create a new black image, as ImageCreate.
+  Image(int width, int height, uint8 maxval = PixMax) : Image(nullptr, width, height, maxval) {}
+
+  /// Create a new black image in context ctx, as ImageCreateCtx.
+  Image(ImageContext ctx, int width, int height, uint8 maxval = PixMax)
+      : img_(ImageCreateCtx(ctx, width, height, maxval))
+  {
+    if (img_ == nullptr)
+      throw Error("ImageCreate");
+  }
+
+  /// Create a new image with the result of an expression
+  /// (in the context of its source).
+  template <class Op>
+  Image(const Pointwise<Op> &e)
+      : Image(ImageGetContext(e.src.img_), e.src.width(), e.src.height(), (uint8)e.src.maxval())
+  {
+    apply(img_, e.src.img_, e.op);
+  }
+
+  Image(const Image &) = delete;
+  Image &operator=(const Image &) = delete;
+
+  Image(Image &&other) noexcept : img_(other.release()) {}
+
+  Image &operator=(Image &&other) noexcept
+  {
+    if (this != &other)
+      reset(other.release());
+    return *this;
+  }
+
+  ~Image() { ImageDestroy(&img_); }
+
+  /// Assign the result of an expression.
+  /// If the source is this image, it is changed in-place; otherwise the
+  /// pixels are reused if the size and maxval are the same.
+  template <class Op>
+  Image &operator=(const Pointwise<Op> &e)
+  {
+    ::Image src = e.src.img_;
+    if (img_ == nullptr || src != img_)
+    {
+      if (img_ == nullptr || width() != e.src.width() || height() != e.src.height() ||
+          maxval() != e.src.maxval())
+        *this = Image(ImageGetContext(src), e.src.width(), e.src.height(), (uint8)e.src.maxval());
+    }
+    apply(img_, src, e.op);
+    return *this;
+  }
+
+  /// Apply a pointwise operation in-place.
+  template <class Op, EnableIfPointwise<Op> = 0>
+  Image &operator|=(Op op)
+  {
+    apply(img_, img_, op);
+    return *this;
+  }
+
+  /// Load a PGM (or PBM) file, as ImageLoadCtx.
+  static Image load(const std::string &filename, ImageContext ctx = nullptr)
+  {
+    ::Image img = ImageLoadCtx(ctx, filename.c_str());
+    if (img == nullptr)
+      throw Error(filename);
+    return Image(img);
+  }
+
+  /// Save to a PGM file, as ImageSave.
+  void save(const std::string &filename) const
+  {
+    if (ImageSave(img_, filename.c_str()) == 0)
+      throw Error(filename);
+  }
+
+  /// A copy of this image (the only way to copy).
+  Image clone() const { return crop(0, 0, width(), height()); }
+
+  /// The C image, still owned by this object.
+  ::Image get() const noexcept { return img_; }
+
+  /// Give up ownership of the C image (this object becomes empty).
+  ::Image release() noexcept { return std::exchange(img_, nullptr); }
+
+  /// Destroy the image, and take ownership of img (which may be NULL).
+  void reset(::Image img = nullptr) noexcept
+  {
+    ImageDestroy(&img_);
+    img_ = img;
+  }
+
+  /// Check if there is an image.
+  explicit operator bool() const noexcept { return img_ != nullptr; }
+
+  /// Information queries
+
+  int width() const { return ImageWidth(img_); }
+  int height() const { return ImageHeight(img_); }
+  int maxval() const { return ImageMaxval(img_); }
+
+  /// Get the pixel at position (x,y), as ImageGetPixel.
+  uint8 operator()(int x, int y) const { return ImageGetPixel(img_, x, y); }
+
+  /// Set the pixel at position (x,y), as ImageSetPixel.
+  void set(int x, int y, uint8 level) { ImageSetPixel(img_, x, y, level); }
+
+  /// Geometric transformations (new images, as the C functions)
+
+  Image rotate() const { return check(ImageRotate(img_), "ImageRotate"); }
+  Image mirror() const { return check(ImageMirror(img_), "ImageMirror"); }
+  Image transform(ImageOrientation o) const { return check(ImageTransform(img_, o), "ImageTransform"); }
+  Image crop(int x, int y, int w, int h) const { return check(ImageCrop(img_, x, y, w, h), "ImageCrop"); }
+
+  /// Operations in-place (as the C functions)
+
+  void paste(int x, int y, const Image &img2) { ImagePaste(img_, x, y, img2.img_); }
+  void blend(int x, int y, const Image &img2, double alpha) { ImageBlend(img_, x, y, img2.img_, alpha); }
+  void blur(int dx, int dy) { ImageBlur(img_, dx, dy); }
+
+  /// Locate img2 in this image, as ImageLocateSubImage.
+  /// Returns the position (x, y) of the match, if found.
+  std::optional<std::pair<int, int>> locate(const Image &img2) const
+  {
+    int x, y;
+    if (ImageLocateSubImage(img_, &x, &y, img2.img_))
+      return std::make_pair(x, y);
+    return std::nullopt;
+  }
+
+private:
+  ::Image img_ = nullptr;
+
+  // Take ownership of the result of a C function, or throw if it failed.
+  static Image check(::Image img, const char *what)
+  {
+    if (img == nullptr)
+      throw Error(what);
+    return Image(img);
+  }
+
+  // Set each pixel of dst to op of the pixel of src (which may be dst).
+  // Requires: dst and src have the same size and maxval.
+  template <class Op>
+  static void apply(::Image dst, ::Image src, const Op &op)
+  {
+    assert(dst != nullptr && src != nullptr);
+    int w = ImageWidth(src);
+    int h = ImageHeight(src);
+    int maxval = ImageMaxval(src);
+    for (int y = 0; y < h; y++)
+    {
+      const uint8 *in = ImageRowPtr(src, y);
+      uint8 *out = ImageMutableRowPtr(dst, y);
+      for (int x = 0; x < w; x++)
+        out[x] = op(in[x], maxval);
+    }
+  }
+};
+
+/// Build an expression: op applied to img.
+template <class Op, EnableIfPointwise<Op> = 0>
+Pointwise<Op> operator|(const Image &img, Op op)
+{
+  return {img, op};
+}
+
+/// Extend an expression with another operation.
+template <class Op, class Next, EnableIfPointwise<Next> = 0>
+Pointwise<Compose<Op, Next>> operator|(const Pointwise<Op> &e, Next next)
+{
+  return {e.src, {e.op, next}};
+}
+
+} // namespace img8
+
+#endif
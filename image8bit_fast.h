@@ -0,0 +1,50 @@
+/// image8bit_fast - Inlinable, unchecked pixel access for image8bit.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// ImageGetPixel and ImageSetPixel are functions in image8bit.c, so each
+/// call from another file costs a call, the contract assertions and a
+/// counter increment.  This header exposes the image structure and defines
+/// static inline equivalents, so that per-pixel loops in client code (e.g.
+/// custom filters) compile to plain loads and stores.
+///
+/// It is opt-in: include it only where that matters.  The accessors do not
+/// check their preconditions (not even with assertions) and are not counted
+/// by instrumentation, so debug and count with the image8bit.h functions.
+/// The image structure may change: clients should still use its fields only
+/// through the functions below.
+
+#ifndef IMAGE8BIT_FAST_H
+#define IMAGE8BIT_FAST_H
+
+#include "image8bit.h"
+
+#include <stddef.h>
+
+// Internal structure for storing 8-bit graymap images
+// (see the description of the data structure in image8bit.c)
+struct image
+{
+  int width;
+  int height;
+  int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
+  uint8 *pixel; // pixel data (a raster scan)
+  ImageContext ctx; // context of the image (NULL if none)
+};
+
+/// Get the pixel (level) at position (x,y), as ImageGetPixel.
+/// Requires (unchecked): ImageValidPos(img, x, y).
+static inline uint8 ImageGetPixelFast(Image img, int x, int y)
+{
+  return img->pixel[(size_t)y * img->width + x];
+}
+
+/// Set the pixel at position (x,y) to new level, as ImageSetPixel.
+/// Requires (unchecked): ImageValidPos(img, x, y).
+static inline void ImageSetPixelFast(Image img, int x, int y, uint8 level)
+{
+  img->pixel[(size_t)y * img->width + x] = level;
+}
+
+#endif
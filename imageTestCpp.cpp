@@ -0,0 +1,84 @@
+// imageTestCpp - A test of the C++ interface to the image8bit module.
+//
+// Checks that the pointwise expressions of image8bit.hpp give the same
+// pixels as the C functions, and that moving an img8::Image transfers the
+// ownership of its image (which is destroyed only once).
+// Exits with status 1 if a check fails.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+
+#include <cstdio>
+#include <utility>
+#include "image8bit.hpp"
+
+static int failures = 0;
+
+static void expect(bool ok, const char *what)
+{
+  if (!ok)
+  {
+    std::printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+// Check that img | neg() | thr(128) | bri(.33) matches the C functions.
+static void testPointwise()
+{
+  img8::Image img(::ImageSynthetic(300, 200, SYNTH_NOISE, 1));
+  expect((bool)img, "ImageSynthetic");
+  img8::Image out = img | img8::neg() | img8::thr(128) | img8::bri(.33);
+
+  ::Image ref = ImageCrop(img.get(), 0, 0, img.width(), img.height());
+  ImageNegative(ref);
+  ImageThreshold(ref, 128);
+  ImageBrighten(ref, .33);
+  expect(out.width() == ImageWidth(ref) && out.height() == ImageHeight(ref) &&
+             out.maxval() == ImageMaxval(ref),
+         "expression has the size and maxval of the C result");
+  expect(ImageMatchSubImage(out.get(), 0, 0, ref) == 1, "expression matches the C functions");
+
+  // In-place, the same
+  img |= img8::neg() | img8::thr(128) | img8::bri(.33);
+  expect(ImageMatchSubImage(img.get(), 0, 0, ref) == 1, "in-place expression matches the C functions");
+  ImageDestroy(&ref);
+}
+
+// Check that a moved-from image is empty and is not destroyed again.
+// The pixels of a destroyed image go back to the pool of its context,
+// so the next images of the same size reuse them: if the image were
+// destroyed twice, its buffer would be in the pool twice.
+static void testMove()
+{
+  img8::Context ctx;
+  unsigned long hits0, misses0, hits, misses;
+  {
+    img8::Image a(ctx, 256, 256);
+    ::Image raw = a.get();
+    img8::Image b(std::move(a));
+    expect(!a && a.get() == nullptr, "moved-from image is empty");
+    expect(b.get() == raw, "moved-to image owns the C image");
+    img8::Image c;
+    c = std::move(b);
+    expect(!b && c.get() == raw, "move assignment transfers the C image");
+  } // a, b, c destroyed here: the C image only once
+  ImageContextPoolStats(ctx, &hits0, &misses0);
+  {
+    img8::Image d(ctx, 256, 256);
+    img8::Image e(ctx, 256, 256);
+    ImageContextPoolStats(ctx, &hits, &misses);
+    expect(d.get() != e.get(), "new images are distinct");
+    expect(hits - hits0 == 1 && misses - misses0 == 1, "the pixels of the moved image were pooled once");
+  }
+}
+
+int main()
+{
+  ImageInit();
+  testPointwise();
+  testMove();
+  if (failures == 0)
+    std::printf("All tests passed\n");
+  return failures == 0 ? 0 : 1;
+}
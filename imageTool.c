@@ -15,12 +15,18 @@
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
+#include "pipeline.h"
 
 static const char *USAGE =
-    "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "USAGE: imageTool [--profile REPORT] [--lazy] [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool [--profile REPORT] --batch LIST --out DIR [--threads N] [OPERATION [OPERAND...]]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -31,12 +37,14 @@ static const char *USAGE =
     "  Most operations apply to CURR and some also use PRED.\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
+    "  Image files in 8-bit raw PGM format, or raw PBM format (binary images,\n"
+    "  loaded with levels 0 and 255), are accepted.\n"
     "  Input file names must be distinct from operation names.\n"
     "\n"
     "OPERATIONS:\n"
-    "  FILE            Load PGM image file, creating new image\n"
-    "  save FILE       Save CURR to PGM file\n"
+    "  FILE            Load PGM or PBM image file, creating new image\n"
+    "  save FILE       Save CURR to PGM file, or to PBM file if FILE ends in\n"
+    "                  .pbm (pixels of at least half maxval are white)\n"
     "  info            Show information on CURR (size and range)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
@@ -48,20 +56,55 @@ static const char *USAGE =
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
+    "                  (Consecutive rotate/mirror are done in a single pass.)\n"
+    "  irotate         Rotate square CURR 90º counter-clockwise, in-place\n"
+    "  irotatecw       Rotate square CURR 90º clockwise, in-place\n"
+    "  rotate180       Rotate CURR 180º, in-place\n"
+    "  transform ORIENT  Transform CURR to orientation ORIENT, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
     "\n"
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "                  (64 pixels at a time if both were loaded from PBM files)\n"
+    "  alocate MAXERR  As locate, for binary images (CURR and PRED as saved to\n"
+    "                  PBM), but up to MAXERR pixels may differ\n"
     "\n"
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
     "\n"
+    "LAZY MODE:\n"
+    "  With --lazy, the whole pipeline is parsed and optimized before running.\n"
+    "  Images are only computed when needed by save, info or locate:\n"
+    "  level operations are fused, inverse geometric operations cancel out,\n"
+    "  crops are done before level operations, and unused images are skipped.\n"
+    "  The results are the same as without --lazy.\n"
+    "\n"
+    "PROFILING:\n"
+    "  With --profile, each operation is timed, and a report with the wall\n"
+    "  time, CPU time and instrumentation counts of each one (repeated\n"
+    "  operations are added up) is written to file REPORT at the end:\n"
+    "  in CSV if its name ends in .csv, JSON otherwise (- for stdout).\n"
+    "  With --lazy, the report is a tree of the images computed for each\n"
+    "  output operation.\n"
+    "\n"
+    "BATCH MODE:\n"
+    "  With --batch, the pipeline is applied to each file in LIST, which is\n"
+    "  either a wildcard pattern (quoted, e.g. 'pgm/*.pgm') or a text file\n"
+    "  with one file name per line.  Each input file is loaded as I0, and\n"
+    "  the final CURR is saved to DIR, with the same file name (so the\n"
+    "  file names must be distinct, or the batch fails before starting).\n"
+    "  The pipeline is parsed and optimized (as with --lazy) only once,\n"
+    "  and files are processed by N threads (default: one per CPU).\n"
+    "  Throughput is reported at the end.\n"
+    "\n"
     "OPERANDS:\n"
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
+    "  ORIENT          id, rot90, rot180, rot270 (counter-clockwise rotations),\n"
+    "                  flipx, flipy, transpose, antitranspose\n"
     "\n";
 
 static char *errors[] = {
@@ -73,7 +116,369 @@ static char *errors[] = {
     "Invalid operand",
     "Invalid rect (overflow)",
     "Invalid alpha",
+    "Image is not square",
+    "Batch failed",
+};
+
+// Names of orientations for the transform operation,
+// in the order of enum ImageOrientation.
+static const char *orientNames[] = {
+    "id", "rot90", "rot180", "rot270",
+    "flipx", "flipy", "transpose", "antitranspose",
+};
+
+// Find the orientation with the given name.  Returns -1 if there is none.
+static int orientation(const char *name)
+{
+  for (int o = 0; o < 8; o++)
+  {
+    if (strcmp(name, orientNames[o]) == 0)
+      return o;
+  }
+  return -1;
+}
+
+// Operations and how they use the image buffer.
+// This is used to look ahead in the pipeline.
+static const struct
+{
+  const char *name;
+  int operands; // number of operand arguments
+  int creates;  // appends a new image to the buffer?
+  int usesPred; // uses PRED?
+  int modifies; // modifies CURR in place?
+} operations[] = {
+    {"save", 1, 0, 0, 0},      {"info", 0, 0, 0, 0},      {"tic", 0, 0, 0, 0},
+    {"toc", 0, 0, 0, 0},       {"neg", 0, 0, 0, 1},       {"thr", 1, 0, 0, 1},
+    {"bri", 1, 0, 0, 1},       {"create", 1, 1, 0, 0},    {"rotate", 0, 1, 0, 0},
+    {"mirror", 0, 1, 0, 0},    {"transform", 1, 1, 0, 0}, {"irotate", 0, 0, 0, 1},
+    {"irotatecw", 0, 0, 0, 1}, {"rotate180", 0, 0, 0, 1}, {"crop", 1, 1, 0, 0},
+    {"paste", 1, 0, 1, 1},     {"blend", 1, 0, 1, 1},     {"locate", 0, 0, 1, 0},
+    {"alocate", 1, 0, 1, 0},   {"blur", 1, 0, 0, 1},
 };
+#define NUMOPERATIONS (int)(sizeof(operations) / sizeof(operations[0]))
+
+// Count the consecutive rotate/mirror operations starting at av[k].
+static int geometricRun(int ac, char *av[], int k)
+{
+  int run = 0;
+  while (k + run < ac &&
+         (strcmp(av[k + run], "rotate") == 0 || strcmp(av[k + run], "mirror") == 0))
+    run++;
+  return run;
+}
+
+// Check if the pipeline starting at av[k] uses PRED before appending
+// any new image to the buffer.
+static int predNeeded(int ac, char *av[], int k)
+{
+  while (k < ac)
+  {
+    int i = 0;
+    while (i < NUMOPERATIONS && strcmp(av[k], operations[i].name) != 0)
+      i++;
+    if (i == NUMOPERATIONS)
+      return 0; // an image file
+    if (operations[i].usesPred)
+      return 1;
+    if (operations[i].creates)
+      return 0;
+    k += 1 + operations[i].operands;
+  }
+  return 0;
+}
+
+// State shared by the batch mode threads.
+struct batch
+{
+  Pipeline p;
+  char **files;
+  int numFiles;
+  const char *dir;
+  pthread_mutex_t lock; // protects the fields below
+  int next;             // next file to process
+  int failed;           // number of files that failed
+  unsigned long pixels; // pixels loaded
+};
+
+// File name part of path: the output name of a batch input file.
+static const char *baseName(const char *path)
+{
+  const char *base = strrchr(path, '/');
+  return base != NULL ? base + 1 : path;
+}
+
+static int compareNames(const void *a, const void *b)
+{
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Find two batch input files with the same output name.
+// Returns one of them, or NULL if the output names are all distinct
+// (or on failure to check).
+static const char *duplicateOutput(char **files, int n)
+{
+  const char **names = malloc((size_t)n * sizeof(char *) + 1);
+  if (names == NULL)
+    return NULL;
+  for (int i = 0; i < n; i++)
+    names[i] = baseName(files[i]);
+  qsort(names, n, sizeof(char *), compareNames);
+  const char *dup = NULL;
+  for (int i = 1; i < n && dup == NULL; i++)
+  {
+    if (strcmp(names[i - 1], names[i]) == 0)
+      dup = names[i];
+  }
+  free(names);
+  return dup;
+}
+
+// Batch mode thread: process files until there are no more.
+static void *batchWorker(void *arg)
+{
+  struct batch *b = arg;
+  InstrThreadInit(); // count this thread's operations in toc
+  for (;;)
+  {
+    pthread_mutex_lock(&b->lock);
+    int i = b->next++;
+    pthread_mutex_unlock(&b->lock);
+    if (i >= b->numFiles)
+      break;
+
+    const char *input = b->files[i];
+    const char *base = baseName(input);
+    char *output = malloc(strlen(b->dir) + strlen(base) + 2);
+    unsigned long pixels = 0;
+    int err = 4;
+    if (output != NULL)
+    {
+      sprintf(output, "%s/%s", b->dir, base);
+      err = PipelineRunOn(b->p, input, output, &pixels);
+    }
+    int errnum = errno;
+
+    pthread_mutex_lock(&b->lock);
+    b->pixels += pixels;
+    if (err != 0)
+    {
+      char msg[256];
+      snprintf(msg, sizeof(msg), errors[err], ImageErrMsg());
+      error(0, errnum, "%s: %s", input, msg);
+      b->failed++;
+    }
+    pthread_mutex_unlock(&b->lock);
+    free(output);
+  }
+  return NULL;
+}
+
+// Get the input files of a batch: expand a wildcard pattern,
+// or read file names from a list file, one per line.
+// Returns 0 on failure (errno is set).
+static int batchFiles(const char *list, glob_t *g)
+{
+  if (strpbrk(list, "*?[") != NULL)
+  {
+    int r = glob(list, 0, NULL, g);
+    if (r == GLOB_NOMATCH)
+      g->gl_pathc = 0;
+    else if (r != 0)
+    {
+      errno = ENOMEM;
+      return 0;
+    }
+    return 1;
+  }
+  FILE *f = fopen(list, "r");
+  if (f == NULL)
+    return 0;
+  // Read names into a glob_t-like array, so both cases are freed alike
+  size_t cap = 16;
+  g->gl_pathc = 0;
+  g->gl_pathv = malloc(cap * sizeof(char *));
+  char line[4096];
+  while (g->gl_pathv != NULL && fgets(line, sizeof(line), f) != NULL)
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0')
+      continue;
+    if (g->gl_pathc + 1 >= cap)
+    {
+      cap *= 2;
+      char **v = realloc(g->gl_pathv, cap * sizeof(char *));
+      if (v == NULL)
+        break;
+      g->gl_pathv = v;
+    }
+    char *name = malloc(strlen(line) + 1);
+    if (name == NULL)
+      break;
+    g->gl_pathv[g->gl_pathc++] = strcpy(name, line);
+  }
+  int ok = g->gl_pathv != NULL && !ferror(f) && feof(f);
+  fclose(f);
+  if (!ok)
+    errno = ENOMEM;
+  return ok;
+}
+
+// Batch mode: imageTool --batch LIST --out DIR [--threads N] PIPELINE.
+// Returns an error code (index of errors).
+static int batch(int ac, char *av[])
+{
+  if (ac < 5 || strcmp(av[3], "--out") != 0)
+    return 1;
+  const char *list = av[2];
+  const char *dir = av[4];
+  int k = 5;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (k < ac && strcmp(av[k], "--threads") == 0)
+  {
+    if (k + 1 >= ac)
+      return 1;
+    if (sscanf(av[k + 1], "%ld", &threads) != 1 || threads < 1)
+      return 5;
+    k += 2;
+  }
+  if (threads < 1)
+    threads = 1;
+
+  int err;
+  Pipeline p = PipelineParseBatch(ac - k, av + k, &err);
+  if (p == NULL)
+    return err;
+  PipelineOptimize(p);
+
+  glob_t g;
+  if (!batchFiles(list, &g))
+  {
+    error(0, errno, "%s", list);
+    PipelineDestroy(&p);
+    errno = 0;
+    return 9;
+  }
+  // Outputs are named after the inputs, so two inputs with the same name
+  // (in different directories) would overwrite each other's output
+  const char *dup = duplicateOutput(g.gl_pathv, (int)g.gl_pathc);
+  if (dup != NULL)
+  {
+    error(0, 0, "%s/%s: output of more than one input file", dir, dup);
+    err = 9;
+  }
+  else if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+  {
+    error(0, errno, "%s", dir);
+    err = 9;
+  }
+  struct batch b = {p, g.gl_pathv, (int)g.gl_pathc, dir};
+  pthread_mutex_init(&b.lock, NULL);
+  if (threads > b.numFiles)
+    threads = b.numFiles > 0 ? b.numFiles : 1;
+
+  if (err == 0)
+  {
+    fprintf(stderr, "Processing %d files with %ld threads -> %s\n", b.numFiles, threads, dir);
+    double t0 = wall_time();
+    pthread_t tid[threads];
+    long started = 0;
+    while (started < threads &&
+           pthread_create(&tid[started], NULL, batchWorker, &b) == 0)
+      started++;
+    if (started == 0)
+      batchWorker(&b); // no threads? do it here
+    for (long t = 0; t < started; t++)
+      pthread_join(tid[t], NULL);
+    double dt = wall_time() - t0;
+
+    printf("# Batch: %d files (%d failed) in %.3f s: %.1f files/s, %.1f MPix/s\n",
+           b.numFiles, b.failed, dt, dt > 0 ? b.numFiles / dt : 0.0,
+           dt > 0 ? b.pixels / dt / 1e6 : 0.0);
+    fflush(stdout);
+    if (b.failed > 0)
+      err = 9;
+  }
+
+  pthread_mutex_destroy(&b.lock);
+  if (strpbrk(list, "*?[") != NULL)
+    globfree(&g);
+  else
+  {
+    for (size_t i = 0; i < g.gl_pathc; i++)
+      free(g.gl_pathv[i]);
+    free(g.gl_pathv);
+  }
+  PipelineDestroy(&p);
+  errno = 0;
+  return err;
+}
+
+// Report file for --profile (NULL if not profiling).
+static const char *profileFile = NULL;
+
+// Write the profiling report, if requested.
+static void writeProfile(void)
+{
+  if (profileFile == NULL)
+    return;
+  int errsave = errno;
+  size_t len = strlen(profileFile);
+  int format = len >= 4 && strcmp(profileFile + len - 4, ".csv") == 0 ? INSTR_CSV : INSTR_JSON;
+  FILE *f = strcmp(profileFile, "-") == 0 ? stdout : fopen(profileFile, "w");
+  if (f == NULL)
+  {
+    error(0, errno, "%s", profileFile);
+  }
+  else
+  {
+    InstrReport(f, format);
+    if (f != stdout)
+      fclose(f);
+  }
+  errno = errsave;
+}
+
+// Does file name end in .pbm?
+static int isPbm(const char *file)
+{
+  size_t len = strlen(file);
+  return len >= 4 && strcmp(file + len - 4, ".pbm") == 0;
+}
+
+// Get the bitmap of image img: bmp if it is not NULL (img was loaded from
+// a PBM file), or else a new one with the pixels of at least half maxval
+// set, which the caller must destroy.
+// Returns NULL on failure.
+static Bitmap bitmapOf(Image img, Bitmap bmp, Bitmap *created)
+{
+  *created = NULL;
+  if (bmp != NULL)
+    return bmp;
+  return *created = ImageThresholdToBitmap(img, (uint8)((ImageMaxval(img) + 1) / 2));
+}
+
+// Does the operation at av[k] modify CURR in place?
+static int modifiesCurr(char *av[], int k)
+{
+  for (int i = 0; i < NUMOPERATIONS; i++)
+  {
+    if (strcmp(av[k], operations[i].name) == 0)
+      return operations[i].modifies;
+  }
+  return 0;
+}
+
+// Name of the timing region for the operation at av[k].
+static const char *regionName(char *av[], int k)
+{
+  for (int i = 0; i < NUMOPERATIONS; i++)
+  {
+    if (strcmp(av[k], operations[i].name) == 0)
+      return operations[i].name;
+  }
+  return "load";
+}
 
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
@@ -85,23 +490,59 @@ static char *errors[] = {
 
 int main(int ac, char* av[]) {
   program_name = av[0];
+  if (ac > 2 && strcmp(av[1], "--profile") == 0) {
+    profileFile = av[2];
+    av[2] = av[0];
+    av += 2;
+    ac -= 2;
+  }
   if (ac <= 1) {
     error(5, 0, "\n%s", USAGE);
   }
 
   ImageInit();
 
+  if (strcmp(av[1], "--lazy") == 0) {
+    int err;
+    Pipeline p = PipelineParse(ac - 2, av + 2, &err);
+    if (p != NULL) {
+      PipelineOptimize(p);
+      err = PipelineRun(p, profileFile != NULL);
+      PipelineDestroy(&p);
+    }
+    ImagePoolRelease();
+    writeProfile();
+    error(err, errno, errors[err], ImageErrMsg());
+    return 0;
+  }
+
+  if (strcmp(av[1], "--batch") == 0) {
+    InstrBegin("batch");
+    int err = batch(ac, av);
+    InstrEnd();
+    ImagePoolRelease();
+    writeProfile();
+    error(err, errno, errors[err], ImageErrMsg());
+    return 0;
+  }
+
   int err = 0;
   int x, y, w, h;
 
   // The image buffer
   const int N = 10; // buffer capacity
   Image img[N];     // the images
+  Bitmap bmp[N];    // and their bitmaps, if loaded from PBM and unmodified
   int n = 0;        // number of images created
+  for (int i = 0; i < N; i++)
+    bmp[i] = NULL;
 
   int k = 1;
   while (k < ac)
   {
+    if (profileFile != NULL) InstrBegin(regionName(av, k));
+    if (n > 0 && modifiesCurr(av, k))
+      BitmapDestroy(&bmp[n - 1]); // no longer the same image
     if (strcmp(av[k], "info") == 0)
     {
       if (n < 1)
@@ -209,7 +650,7 @@ int main(int ac, char* av[]) {
       }
       n++;
     }
-    else if (strcmp(av[k], "rotate") == 0)
+    else if (strcmp(av[k], "rotate") == 0 || strcmp(av[k], "mirror") == 0)
     {
       if (n < 1)
       {
@@ -221,17 +662,48 @@ int main(int ac, char* av[]) {
         err = 3;
         break;
       }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n - 1, n);
-      img[n] = ImageRotate(img[n - 1]);
+      // A run of consecutive rotate/mirror operations is collapsed into a
+      // single transformation, producing the last image in one pass.
+      // If PRED will be used, the last step is kept apart, so that PRED
+      // is the same image it would be without collapsing.
+      int run = geometricRun(ac, av, k);
+      if (run > 1 && predNeeded(ac, av, k + run))
+        run--;
+      if (run == 1 && strcmp(av[k], "rotate") == 0)
+      {
+        fprintf(stderr, "Rotating I%d -> I%d\n", n - 1, n);
+        img[n] = ImageRotate(img[n - 1]);
+      }
+      else if (run == 1)
+      {
+        fprintf(stderr, "Mirroring I%d -> I%d\n", n - 1, n);
+        img[n] = ImageMirror(img[n - 1]);
+      }
+      else
+      {
+        ImageOrientation o = ORIENT_IDENTITY;
+        for (int i = 0; i < run; i++)
+        {
+          o = ImageOrientationCompose(o, strcmp(av[k + i], "rotate") == 0 ? ORIENT_ROT90 : ORIENT_FLIPX);
+        }
+        fprintf(stderr, "Transforming I%d (%d steps = %s) -> I%d\n", n - 1, run, orientNames[o], n);
+        img[n] = ImageTransform(img[n - 1], o);
+      }
       if (img[n] == NULL)
       {
         err = 4;
         break;
       }
       n++;
+      k += run - 1;
     }
-    else if (strcmp(av[k], "mirror") == 0)
+    else if (strcmp(av[k], "transform") == 0)
     {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      }
       if (n < 1)
       {
         err = 2;
@@ -242,8 +714,14 @@ int main(int ac, char* av[]) {
         err = 3;
         break;
       }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n - 1, n);
-      img[n] = ImageMirror(img[n - 1]);
+      int o = orientation(av[k]);
+      if (o < 0)
+      {
+        err = 5;
+        break;
+      }
+      fprintf(stderr, "Transforming I%d (%s) -> I%d\n", n - 1, orientNames[o], n);
+      img[n] = ImageTransform(img[n - 1], (ImageOrientation)o);
       if (img[n] == NULL)
       {
         err = 4;
@@ -251,6 +729,39 @@ int main(int ac, char* av[]) {
       }
       n++;
     }
+    else if (strcmp(av[k], "irotate") == 0 || strcmp(av[k], "irotatecw") == 0)
+    {
+      if (n < 1)
+      {
+        err = 2;
+        break;
+      }
+      if (ImageWidth(img[n - 1]) != ImageHeight(img[n - 1]))
+      {
+        err = 8;
+        break;
+      } // precondition check!
+      if (strcmp(av[k], "irotate") == 0)
+      {
+        fprintf(stderr, "Rotating I%d counter-clockwise in-place\n", n - 1);
+        ImageRotateInPlace(img[n - 1]);
+      }
+      else
+      {
+        fprintf(stderr, "Rotating I%d clockwise in-place\n", n - 1);
+        ImageRotateClockwiseInPlace(img[n - 1]);
+      }
+    }
+    else if (strcmp(av[k], "rotate180") == 0)
+    {
+      if (n < 1)
+      {
+        err = 2;
+        break;
+      }
+      fprintf(stderr, "Rotating I%d 180º in-place\n", n - 1);
+      ImageRotate180(img[n - 1]);
+    }
     else if (strcmp(av[k], "crop") == 0)
     {
       if (++k >= ac)
@@ -350,7 +861,12 @@ int main(int ac, char* av[]) {
         break;
       }
       fprintf(stderr, "Locating I%d in I%d\n", n - 2, n - 1);
-      if (ImageLocateSubImage(img[n - 1], &x, &y, img[n - 2]))
+      int found;
+      if (bmp[n - 1] != NULL && bmp[n - 2] != NULL)
+        found = BitmapLocateSubBitmap(bmp[n - 1], &x, &y, bmp[n - 2]);
+      else
+        found = ImageLocateSubImage(img[n - 1], &x, &y, img[n - 2]);
+      if (found)
       {
         printf("# FOUND (%d,%d)\n", x, y);
       }
@@ -359,6 +875,47 @@ int main(int ac, char* av[]) {
         printf("# NOTFOUND\n");
       }
     }
+    else if (strcmp(av[k], "alocate") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      }
+      if (n < 2)
+      {
+        err = 2;
+        break;
+      }
+      int maxerr;
+      if (sscanf(av[k], "%d", &maxerr) != 1 || maxerr < 0)
+      {
+        err = 5;
+        break;
+      }
+      fprintf(stderr, "Locating I%d in I%d, with up to %d different pixels\n", n - 2, n - 1, maxerr);
+      Bitmap new1, new2;
+      Bitmap bmp1 = bitmapOf(img[n - 1], bmp[n - 1], &new1);
+      Bitmap bmp2 = bitmapOf(img[n - 2], bmp[n - 2], &new2);
+      if (bmp1 == NULL || bmp2 == NULL)
+      {
+        BitmapDestroy(&new1);
+        BitmapDestroy(&new2);
+        err = 4;
+        break;
+      }
+      if (BitmapLocateApprox(bmp1, &x, &y, bmp2, maxerr))
+      {
+        printf("# FOUND (%d,%d) with %d different pixels\n", x, y,
+               BitmapMismatches(bmp1, x, y, bmp2, maxerr));
+      }
+      else
+      {
+        printf("# NOTFOUND\n");
+      }
+      BitmapDestroy(&new1);
+      BitmapDestroy(&new2);
+    }
     else if (strcmp(av[k], "blur") == 0)
     {
       if (++k >= ac)
@@ -394,7 +951,19 @@ int main(int ac, char* av[]) {
         break;
       }
       fprintf(stderr, "Saving %s <- I%d\n", av[k], n - 1);
-      if (ImageSave(img[n - 1], av[k]) == 0)
+      int saved;
+      if (isPbm(av[k]))
+      {
+        Bitmap created;
+        Bitmap b = bitmapOf(img[n - 1], bmp[n - 1], &created);
+        saved = b != NULL && BitmapSave(b, av[k]);
+        BitmapDestroy(&created);
+      }
+      else
+      {
+        saved = ImageSave(img[n - 1], av[k]);
+      }
+      if (!saved)
       {
         err = 4;
         break;
@@ -408,7 +977,17 @@ int main(int ac, char* av[]) {
         break;
       }
       fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
+      if (isPbm(av[k]))
+      { // keep the bitmap too, for locate
+        bmp[n] = BitmapLoad(av[k]);
+        img[n] = bmp[n] != NULL ? BitmapToImage(bmp[n], PixMax) : NULL;
+        if (img[n] == NULL)
+          BitmapDestroy(&bmp[n]);
+      }
+      else
+      {
+        img[n] = ImageLoad(av[k]);
+      }
       if (img[n] == NULL)
       {
         err = 4;
@@ -416,14 +995,18 @@ int main(int ac, char* av[]) {
       }
       n++;
     }
+    if (profileFile != NULL) InstrEnd();
     k++;
   }
 
   // Destroy remaining images
   while (n > 0)
   {
-    ImageDestroy(&img[--n]);
+    BitmapDestroy(&bmp[--n]);
+    ImageDestroy(&img[n]);
   }
+  ImagePoolRelease();
+  writeProfile();
 
   error(err, errno, errors[err], ImageErrMsg());
   return 0;
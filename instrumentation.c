@@ -20,12 +20,34 @@
 /// InstrPrint();  // to show time and counters
 
 #include "instrumentation.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/stat.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 /// Cpu time in seconds
 double cpu_time(void); ///
 
+/// Wall clock time in seconds
+double wall_time(void); ///
+
 #if defined(__linux__) || defined(__APPLE__)
 
 //
@@ -43,6 +65,15 @@ double cpu_time(void)
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void)
+{
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0;
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 #if defined(_MSC_VER) || defined(_WIN32) || defined(_WIN64)
@@ -68,10 +99,73 @@ double cpu_time(void)
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void)
+{
+  return cpu_time(); // already measures elapsed time
+}
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS]; /// extern
+/// Array of operation counters (one per thread):
+INSTR_THREAD unsigned long InstrCount[NUMCOUNTERS]; /// extern
+
+// Registry of the counters of all threads.
+// Each thread that counts has an entry in a linked list, which points to
+// its InstrCount.  When the thread exits, its counts are added to retired.
+// Only the owner thread writes its InstrCount: InstrReset records the
+// counts of the other threads in base, which InstrSnapshot subtracts, so
+// that a reset is not lost to an increment in progress.
+struct instrThread
+{
+  unsigned long *count;
+  unsigned long base[NUMCOUNTERS]; // counts at the last InstrReset
+  struct instrThread *next;
+};
+static INSTR_THREAD struct instrThread self; // this thread's entry
+static INSTR_THREAD int registered = 0;
+static struct instrThread *threads = NULL;   // all entries
+static unsigned long retired[NUMCOUNTERS];   // counts of exited threads
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t exitKey;
+static pthread_once_t exitKeyOnce = PTHREAD_ONCE_INIT;
+
+// Called when a registered thread exits: retire its counts.
+static void threadExit(void *arg)
+{
+  struct instrThread *t = arg;
+  pthread_mutex_lock(&registryLock);
+  for (struct instrThread **pt = &threads; *pt != NULL; pt = &(*pt)->next)
+  {
+    if (*pt == t)
+    {
+      *pt = t->next;
+      break;
+    }
+  }
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    retired[i] += t->count[i] - t->base[i];
+  pthread_mutex_unlock(&registryLock);
+}
+
+static void makeExitKey(void)
+{
+  pthread_key_create(&exitKey, threadExit);
+}
+
+/// Register the counters of the calling thread.
+void InstrThreadInit(void)
+{ ///
+  if (registered)
+    return;
+  pthread_once(&exitKeyOnce, makeExitKey);
+  self.count = InstrCount;
+  pthread_mutex_lock(&registryLock);
+  self.next = threads;
+  threads = &self;
+  pthread_mutex_unlock(&registryLock);
+  pthread_setspecific(exitKey, &self);
+  registered = 1;
+}
 
 /// Array of names for the counters:
 char *InstrName[NUMCOUNTERS] = {NULL}; /// extern
@@ -84,6 +178,16 @@ double InstrTime; /// extern
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0; /// extern
 
+/// Attainable memory bandwidth (in GB/s, 0 if unknown)
+double InstrBW = 0.0; /// extern
+
+/// Indices of the counters of pixels and bytes processed (-1 if none)
+int InstrPixels = -1; /// extern
+int InstrBytes = -1;  /// extern
+
+// Wall clock time read on previous reset
+static double wallTime;
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
@@ -105,12 +209,312 @@ void InstrCalibrate(void)
   InstrCTU = cpu_time() - time;
 }
 
-/// Reset counters to zero and store cpu_time.
+/// Measure the attainable memory bandwidth (InstrBW).
+/// Like the STREAM triad: a[i] = b[i] + s*c[i] on arrays much larger than
+/// the caches, counting 3 x 8 bytes moved per element; the best of a few
+/// runs is kept.  Leaves InstrBW unchanged if memory is not available.
+void InstrProbeBandwidth(void)
+{ ///
+  const size_t n = (size_t)4 << 20; // 32 MiB per array
+  double *a = malloc(n * sizeof(double));
+  double *b = malloc(n * sizeof(double));
+  double *c = malloc(n * sizeof(double));
+  if (a != NULL && b != NULL && c != NULL)
+  {
+    for (size_t i = 0; i < n; i++) // touch all pages before timing
+    {
+      a[i] = 0.0;
+      b[i] = 1.0;
+      c[i] = 2.0;
+    }
+    double best = 0.0;
+    for (int run = 0; run < 4; run++)
+    {
+      double time = wall_time();
+      for (size_t i = 0; i < n; i++)
+        a[i] = b[i] + 3.0 * c[i];
+      time = wall_time() - time;
+      if (time > 0.0 && (best == 0.0 || time < best))
+        best = time;
+      b[run] = a[n - 1 - run]; // so the runs are not optimized away
+    }
+    if (best > 0.0)
+      InstrBW = 3.0 * n * sizeof(double) / best / 1e9;
+  }
+  free(a);
+  free(b);
+  free(c);
+}
+
+// Calibration requested by InstrCalibrateLazy and not done yet?
+static int calibrationPending = 0;
+static pthread_mutex_t calibrationLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Request calibration, but only do it when first needed (by InstrPrint).
+void InstrCalibrateLazy(void)
+{ ///
+  calibrationPending = 1;
+}
+
+/// Get the CPU model name (the key for cached calibrations) into buf.
+void InstrCpuModel(char *buf, size_t size)
+{ ///
+  snprintf(buf, size, "unknown");
+#if defined(__linux__)
+  FILE *f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL)
+    return;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    char *colon = strchr(line, ':');
+    if (strncmp(line, "model name", 10) == 0 && colon != NULL)
+    {
+      snprintf(buf, size, "%s", colon + 2);
+      break;
+    }
+  }
+  fclose(f);
+#elif defined(__APPLE__)
+  size_t len = size;
+  if (sysctlbyname("machdep.cpu.brand_string", buf, &len, NULL, 0) != 0)
+    snprintf(buf, size, "unknown");
+#endif
+  buf[strcspn(buf, "\t\n")] = '\0'; // tabs and newlines separate cache fields
+}
+
+/// Get the path of cache file name into buf.
+int InstrCachePath(const char *name, const char *var, char *buf, size_t size)
+{ ///
+  const char *path = getenv(var);
+  if (path != NULL)
+  {
+    snprintf(buf, size, "%s", path);
+    return path[0] != '\0';
+  }
+  const char *dir = getenv("XDG_CACHE_HOME");
+  if (dir != NULL && dir[0] != '\0')
+    snprintf(buf, size, "%s/%s", dir, name);
+  else if ((dir = getenv("HOME")) != NULL && dir[0] != '\0')
+    snprintf(buf, size, "%s/.cache/%s", dir, name);
+  else
+    return 0;
+  return 1;
+}
+
+/// Open a cache file for appending, creating its directory if needed.
+FILE *InstrCacheAppend(const char *path)
+{ ///
+  FILE *f = fopen(path, "a");
+#if defined(__linux__) || defined(__APPLE__)
+  char dir[1024];
+  snprintf(dir, sizeof(dir), "%s", path);
+  char *slash = strrchr(dir, '/');
+  if (f == NULL && errno == ENOENT && slash != NULL && slash != dir)
+  {
+    *slash = '\0';
+    mkdir(dir, 0755);
+    f = fopen(path, "a");
+  }
+#endif
+  return f;
+}
+
+// Do the calibration requested by InstrCalibrateLazy.
+// The CTU and the memory bandwidth are taken from the INSTR_CTU and
+// INSTR_BW environment variables, if set, or from the cache file line for
+// this CPU model.  Otherwise, they are measured and appended to the cache.
+static void calibrateNow(void)
+{
+  calibrationPending = 0;
+  const char *env;
+  double ctu = 0.0, bw = 0.0;
+  if ((env = getenv("INSTR_CTU")) != NULL && sscanf(env, "%lf", &ctu) == 1 && ctu > 0.0)
+    InstrCTU = ctu;
+  if ((env = getenv("INSTR_BW")) != NULL && sscanf(env, "%lf", &bw) == 1 && bw > 0.0)
+    InstrBW = bw;
+  if (ctu > 0.0 && bw > 0.0)
+    return;
+
+  char model[256], path[1024], line[1024];
+  InstrCpuModel(model, sizeof(model));
+  int cache = InstrCachePath("instr-ctu", "INSTR_CACHE", path, sizeof(path));
+  FILE *f = cache ? fopen(path, "r") : NULL;
+  double cachedCTU = 0.0, cachedBW = 0.0;
+  if (f != NULL)
+  { // Lines are: model TAB ctu [TAB bandwidth]
+    size_t len = strlen(model);
+    while (cachedBW <= 0.0 && fgets(line, sizeof(line), f) != NULL)
+    {
+      double c, m = 0.0;
+      if (strncmp(line, model, len) == 0 && line[len] == '\t' &&
+          sscanf(line + len + 1, "%lf\t%lf", &c, &m) >= 1 && c > 0.0)
+      {
+        cachedCTU = c;
+        cachedBW = m;
+      }
+    }
+    fclose(f);
+  }
+
+  int measured = 0;
+  if (ctu <= 0.0)
+  {
+    if (cachedCTU > 0.0)
+      InstrCTU = cachedCTU;
+    else
+    {
+      InstrCalibrate();
+      measured = 1;
+    }
+  }
+  if (bw <= 0.0)
+  {
+    if (cachedBW > 0.0)
+      InstrBW = cachedBW;
+    else
+    {
+      InstrProbeBandwidth();
+      measured = 1;
+    }
+  }
+  if (measured && cache)
+    f = InstrCacheAppend(path);
+  if (measured && cache && f != NULL)
+  { // Failing to save is not an error: we just calibrate again next time.
+    fprintf(f, "%s\t%.9g\t%.9g\n", model, InstrCTU, InstrBW);
+    fclose(f);
+  }
+}
+
+// Hardware performance counters (Linux perf events)
+//
+// Enabled by setting the INSTR_PERF environment variable (to anything but
+// 0).  Each event is counted in its own file descriptor, for the calling
+// thread and the threads it creates afterwards, in user space only (which
+// is allowed with the default perf_event_paranoid setting).  Events that
+// cannot be opened (no PMU in a VM, seccomp in a container, ...) are simply
+// left out, and if none can be opened a note is printed once.
+
+#define NUMPERF 4
+
+static const struct
+{
+  const char *name;
+  unsigned type;
+  unsigned long long config;
+} perfEvents[NUMPERF] = {
+#if defined(__linux__)
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"br-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+#endif
+};
+
+static int perfFd[NUMPERF];
+static int perfState = 0; // 0: not tried yet, 1: some events open, -1: none
+
+// Open the perf events, if requested and possible.
+static void perfOpen(void)
+{
+  const char *env = getenv("INSTR_PERF");
+  perfState = -1;
+  if (env == NULL || env[0] == '\0' || strcmp(env, "0") == 0)
+    return;
+  int errsave = errno;
+  int err = ENOSYS;
+  for (int e = 0; e < NUMPERF; e++)
+  {
+    perfFd[e] = -1;
+#if defined(__linux__)
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perfEvents[e].type;
+    attr.config = perfEvents[e].config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    perfFd[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perfFd[e] >= 0)
+      perfState = 1;
+    else
+      err = errno;
+#endif
+  }
+  if (perfState < 0)
+    fprintf(stderr, "# Hardware counters unavailable: %s\n", strerror(err));
+  errno = errsave;
+}
+
+// Reset and start the perf events.
+static void perfStart(void)
+{
+  if (perfState == 0)
+    perfOpen();
+#if defined(__linux__)
+  for (int e = 0; e < NUMPERF && perfState > 0; e++)
+  {
+    if (perfFd[e] >= 0)
+    {
+      ioctl(perfFd[e], PERF_EVENT_IOC_RESET, 0);
+      ioctl(perfFd[e], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+#endif
+}
+
+// Read perf event e, scaled up if the event was multiplexed.
+// Returns -1 if the event is not available.
+static double perfRead(int e)
+{
+#if defined(__linux__)
+  unsigned long long v[3]; // value, time enabled, time running
+  if (perfState > 0 && perfFd[e] >= 0 && read(perfFd[e], v, sizeof(v)) == sizeof(v))
+    return v[2] > 0 ? (double)v[0] * v[1] / v[2] : 0.0;
+#endif
+  return -1.0;
+}
+
+/// Reset counters of all threads to zero and store cpu_time.
 void InstrReset(void)
 { ///
+  perfStart();
+  InstrThreadInit();
+  pthread_mutex_lock(&registryLock);
+  for (struct instrThread *t = threads; t != NULL; t = t->next)
+  {
+    for (int i = 0; i < NUMCOUNTERS; i++)
+    {
+      if (t == &self)
+        t->count[i] = t->base[i] = 0ul; // own counters: really reset
+      else
+        t->base[i] = t->count[i];
+    }
+  }
   for (int i = 0; i < NUMCOUNTERS; i++)
-    InstrCount[i] = 0ul;
+    retired[i] = 0ul;
+  pthread_mutex_unlock(&registryLock);
   InstrTime = cpu_time();
+  wallTime = wall_time();
+}
+
+/// Get the sum of the counters of all threads.
+void InstrSnapshot(unsigned long count[NUMCOUNTERS])
+{ ///
+  InstrThreadInit();
+  pthread_mutex_lock(&registryLock);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    count[i] = retired[i];
+  for (struct instrThread *t = threads; t != NULL; t = t->next)
+  {
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      count[i] += t->count[i] - t->base[i];
+  }
+  pthread_mutex_unlock(&registryLock);
 }
 
 // Print times and all named counter values
@@ -118,17 +522,264 @@ void InstrPrint(void)
 { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
+  double wall = wall_time() - wallTime;
+  pthread_mutex_lock(&calibrationLock); // threads may print concurrently
+  if (calibrationPending)
+  {
+    int errsave = errno; // cache file failures are not the caller's errors
+    calibrateNow();
+    errno = errsave;
+  }
+  pthread_mutex_unlock(&calibrationLock);
   // compute time in calibrated time units:
   double caltime = time / InstrCTU;
+  unsigned long count[NUMCOUNTERS];
+  InstrSnapshot(count);
+  double perf[NUMPERF];
+  for (int e = 0; e < NUMPERF; e++)
+    perf[e] = perfRead(e);
+  // Throughput, measured in wall time (which is what matters with threads)
+  double mpix = -1.0, gbs = -1.0;
+  if (InstrPixels >= 0 && wall > 0.0)
+    mpix = count[InstrPixels] / wall / 1e6;
+  if (InstrBytes >= 0 && wall > 0.0)
+    gbs = count[InstrBytes] / wall / 1e9;
 
   printf("#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
+  for (int e = 0; e < NUMPERF; e++)
+    if (perf[e] >= 0.0)
+      printf("\t%15.15s", perfEvents[e].name);
+  if (mpix >= 0.0)
+    printf("\t%15.15s", "MPix/s");
+  if (gbs >= 0.0)
+    printf("\t%15.15s", "GB/s");
+  if (gbs >= 0.0 && InstrBW > 0.0)
+    printf("\t%15.15s", "%bandwidth");
   puts("");
   printf("%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);
+      printf("\t%15lu", count[i]);
+  for (int e = 0; e < NUMPERF; e++)
+    if (perf[e] >= 0.0)
+      printf("\t%15.0f", perf[e]);
+  if (mpix >= 0.0)
+    printf("\t%15.3f", mpix);
+  if (gbs >= 0.0)
+    printf("\t%15.3f", gbs);
+  if (gbs >= 0.0 && InstrBW > 0.0)
+    printf("\t%15.1f", 100.0 * gbs / InstrBW);
   puts("");//Test the blur in the small image in window (1,1)
 }
+
+// Timing regions
+//
+// Regions form a tree: a region begun while another one is open is its
+// child.  Regions with the same name and parent are the same node, so
+// repeated regions (e.g. in a loop) are aggregated.  Node 0 is the root.
+
+#define MAXREGIONS 256
+#define MAXDEPTH 32
+
+static struct region
+{
+  const char *name;
+  int parent, child, next; // indices in regions (child, next: -1 if none)
+  unsigned long calls;
+  double wall, cpu;
+  unsigned long count[NUMCOUNTERS];
+} regions[MAXREGIONS];
+static int numRegions = 0;
+
+// Open regions, innermost last, with the values at the start.
+static struct
+{
+  int region;
+  double wall, cpu;
+  unsigned long count[NUMCOUNTERS];
+} active[MAXDEPTH];
+static int depth = 0;
+static int lost = 0; // regions begun but not recorded (too deep or too many)
+
+// Create the root region, if there is none.
+static void rootInit(void)
+{
+  if (numRegions == 0)
+  {
+    regions[0] = (struct region){"", -1, -1, -1};
+    numRegions = 1;
+  }
+}
+
+/// Begin a timing region.
+void InstrBegin(const char *name)
+{ ///
+  assert(name != NULL);
+  rootInit();
+  int parent = depth > 0 ? active[depth - 1].region : 0;
+  int r = regions[parent].child;
+  while (r >= 0 && strcmp(regions[r].name, name) != 0)
+    r = regions[r].next;
+  if (depth == MAXDEPTH || lost > 0 || (r < 0 && numRegions == MAXREGIONS))
+  { // Not recorded, nor are regions inside it
+    lost++;
+    return;
+  }
+  if (r < 0)
+  {
+    r = numRegions++;
+    regions[r] = (struct region){name, parent, -1, regions[parent].child};
+    regions[parent].child = r;
+  }
+  active[depth].region = r;
+  InstrSnapshot(active[depth].count);
+  active[depth].cpu = cpu_time();
+  active[depth].wall = wall_time();
+  depth++;
+}
+
+/// End the innermost open timing region.
+void InstrEnd(void)
+{ ///
+  double wall = wall_time();
+  double cpu = cpu_time();
+  if (lost > 0)
+  {
+    lost--;
+    return;
+  }
+  if (depth == 0)
+    return;
+  depth--;
+  struct region *r = &regions[active[depth].region];
+  unsigned long count[NUMCOUNTERS];
+  InstrSnapshot(count);
+  r->calls++;
+  r->wall += wall - active[depth].wall;
+  r->cpu += cpu - active[depth].cpu;
+  for (int i = 0; i < NUMCOUNTERS; i++)
+  { // After an InstrReset inside the region, count from the reset
+    unsigned long start = count[i] >= active[depth].count[i] ? active[depth].count[i] : 0;
+    r->count[i] += count[i] - start;
+  }
+}
+
+/// Discard all timing regions.
+void InstrRegionsClear(void)
+{ ///
+  numRegions = depth = lost = 0;
+}
+
+// Print a string as a JSON string literal.
+static void putString(FILE *f, const char *s)
+{
+  putc('"', f);
+  for (; *s != '\0'; s++)
+  {
+    if (*s == '"')
+      fputs("\\\"", f);
+    else if (*s == '\\')
+      fputs("\\\\", f);
+    else if ((unsigned char)*s >= ' ')
+      putc(*s, f);
+  }
+  putc('"', f);
+}
+
+// Print the path of region r (names from the root, separated by /),
+// for a quoted CSV field.
+static void putPath(FILE *f, int r)
+{
+  if (regions[r].parent > 0)
+  {
+    putPath(f, regions[r].parent);
+    putc('/', f);
+  }
+  for (const char *s = regions[r].name; *s != '\0'; s++)
+  {
+    if (*s == '"')
+      putc('"', f); // quotes are doubled in CSV
+    putc(*s, f);
+  }
+}
+
+// Print region r and its children in JSON, indented by level.
+static void reportJSON(FILE *f, int r, int level)
+{
+  struct region *rg = &regions[r];
+  fprintf(f, "%*s{\"name\": ", 2 * level, "");
+  putString(f, rg->name);
+  fprintf(f, ", \"calls\": %lu, \"wall\": %.9f, \"cpu\": %.9f", rg->calls, rg->wall, rg->cpu);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+  {
+    if (InstrName[i] != NULL)
+    {
+      fputs(", ", f);
+      putString(f, InstrName[i]);
+      fprintf(f, ": %lu", rg->count[i]);
+    }
+  }
+  fputs(", \"children\": [", f);
+  // Children are linked newest first: print them in the order begun
+  int child[MAXREGIONS];
+  int n = 0;
+  for (int c = rg->child; c >= 0; c = regions[c].next)
+    child[n++] = c;
+  for (int k = n - 1; k >= 0; k--)
+  {
+    fputs(k == n - 1 ? "\n" : ",\n", f);
+    reportJSON(f, child[k], level + 1);
+  }
+  fprintf(f, n > 0 ? "\n%*s]}" : "]}", 2 * level, "");
+}
+
+/// Write a report of all timing regions to f.
+void InstrReport(FILE *f, int format)
+{ ///
+  assert(f != NULL);
+  assert(format == INSTR_JSON || format == INSTR_CSV);
+  while (depth > 0 || lost > 0)
+    InstrEnd();
+  if (format == INSTR_JSON)
+  {
+    rootInit();
+    fputs("{\"regions\": [", f);
+    int child[MAXREGIONS];
+    int n = 0;
+    for (int c = regions[0].child; c >= 0; c = regions[c].next)
+      child[n++] = c;
+    for (int k = n - 1; k >= 0; k--)
+    {
+      fputs(k == n - 1 ? "\n" : ",\n", f);
+      reportJSON(f, child[k], 1);
+    }
+    fputs("\n]}\n", f);
+    return;
+  }
+  // CSV: one line per region, in the order they were first begun
+  fputs("path,depth,calls,wall,cpu", f);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+  {
+    if (InstrName[i] != NULL)
+      fprintf(f, ",%s", InstrName[i]);
+  }
+  putc('\n', f);
+  for (int r = 1; r < numRegions; r++)
+  {
+    int d = 0;
+    for (int p = regions[r].parent; p > 0; p = regions[p].parent)
+      d++;
+    putc('"', f);
+    putPath(f, r);
+    fprintf(f, "\",%d,%lu,%.9f,%.9f", d, regions[r].calls, regions[r].wall, regions[r].cpu);
+    for (int i = 0; i < NUMCOUNTERS; i++)
+    {
+      if (InstrName[i] != NULL)
+        fprintf(f, ",%lu", regions[r].count[i]);
+    }
+    putc('\n', f);
+  }
+}
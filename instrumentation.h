@@ -10,6 +10,7 @@
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
 /// InstrCalibrate();  // Call once, to measure CTU
+///                    // (or InstrCalibrateLazy(), to measure it when needed)
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -22,14 +23,64 @@
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 /// Cpu time in seconds
 double cpu_time(void); ///
 
+/// Wall clock time in seconds (for measuring multithreaded work)
+double wall_time(void); ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS]; /// extern
+/// Storage class for per-thread variables
+#if defined(_MSC_VER)
+#define INSTR_THREAD __declspec(thread)
+#elif defined(__cplusplus)
+#define INSTR_THREAD thread_local
+#else
+#define INSTR_THREAD _Thread_local
+#endif
+
+/// Array of operation counters.
+/// Each thread has its own array, so threads may count without
+/// interfering with each other.  InstrPrint and InstrSnapshot add up
+/// the counters of all threads that called InstrThreadInit.
+extern INSTR_THREAD unsigned long InstrCount[NUMCOUNTERS]; /// extern
+
+/// Counting level, chosen at compile time (-DINSTR_LEVEL=n):
+///   2 - count every operation (default);
+///   1 - only bulk counts, done once per call with INSTR_BULK;
+///       per-operation counts (INSTR_OP) compile to nothing;
+///   0 - no counting at all.
+/// Hot loops should count with these macros, so that production builds
+/// do not pay for counters nobody reads.
+/// When a count is compiled out, the macro expands to (void)sizeof(n):
+/// n is not evaluated, but variables used only for counting are still
+/// used, so they do not cause unused-variable warnings.
+#ifndef INSTR_LEVEL
+#define INSTR_LEVEL 2
+#endif
+
+/// Add n to counter i, once per basic operation (e.g., per pixel access).
+#if INSTR_LEVEL >= 2
+#define INSTR_OP(i, n) (InstrCount[i] += (n))
+#else
+#define INSTR_OP(i, n) ((void)sizeof(n))
+#endif
+
+/// Add n to counter i, once per call (e.g., the pixels of a whole image).
+#if INSTR_LEVEL >= 1
+#define INSTR_BULK(i, n) (InstrCount[i] += (n))
+#else
+#define INSTR_BULK(i, n) ((void)sizeof(n))
+#endif
 
 /// Array of names for the counters:
 extern char *InstrName[NUMCOUNTERS]; /// extern
@@ -40,14 +91,110 @@ extern double InstrTime; /// extern
 /// Calibrated Time Unit (in seconds, initially 1s)
 extern double InstrCTU; /// extern
 
+/// Attainable memory bandwidth (in GB/s, 0 if unknown)
+extern double InstrBW; /// extern
+
+/// Indices of the counters of pixels and bytes processed (-1 if none).
+/// When set, InstrPrint also shows the throughput in MPix/s and GB/s
+/// (over the wall time since InstrReset), and GB/s as a percentage of
+/// InstrBW.
+extern int InstrPixels; /// extern
+extern int InstrBytes;  /// extern
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
 void InstrCalibrate(void);
 
-/// Reset counters to zero and store cpu_time.
+/// Measure the attainable memory bandwidth, InstrBW, with a STREAM-like
+/// triad loop on arrays larger than the caches (takes about 0.1s).
+void InstrProbeBandwidth(void);
+
+/// Request calibration, but delay it until InstrPrint needs the CTU,
+/// so that programs that never print do not pay for it.
+/// The CTU is then taken from the first of:
+///   - the INSTR_CTU environment variable (in seconds), if set;
+///   - the calibration cache file, for the same CPU model;
+///   - InstrCalibrate(), and the result is added to the cache file.
+/// The memory bandwidth InstrBW is found in the same way, with the
+/// INSTR_BW environment variable (in GB/s) and InstrProbeBandwidth().
+/// The cache file is $INSTR_CACHE, or $XDG_CACHE_HOME/instr-ctu,
+/// or $HOME/.cache/instr-ctu.  Set INSTR_CACHE= (empty) to disable it.
+void InstrCalibrateLazy(void);
+
+/// Cache files, for results measured on this machine (as the calibration).
+/// Lines of cache files should start with the CPU model, so that a file
+/// may be shared by several machines.
+
+/// Get the CPU model name into buf (without tabs or newlines).
+void InstrCpuModel(char *buf, size_t size);
+
+/// Get the path of cache file name into buf: the value of environment
+/// variable var, if set, or else $XDG_CACHE_HOME/name or $HOME/.cache/name.
+/// Returns 0 if there is no such path, or var is set to empty (to disable
+/// the cache).
+int InstrCachePath(const char *name, const char *var, char *buf, size_t size);
+
+/// Open a cache file for appending, creating its directory if needed.
+/// Returns NULL on failure (errno is set).
+FILE *InstrCacheAppend(const char *path);
+
+/// Register the counters of the calling thread, to be included in
+/// InstrPrint and InstrSnapshot (also after the thread exits).
+/// Call at the start of each thread that counts operations.
+/// (InstrReset, InstrPrint and InstrSnapshot register the calling thread.)
+void InstrThreadInit(void);
+
+/// Reset counters of all threads to zero and store cpu_time.
+/// Only the counters of the calling thread are actually set to zero:
+/// the counts of the other threads at this point are recorded, and
+/// subtracted by InstrSnapshot, so a thread that is counting meanwhile
+/// does not lose the reset.
+/// If the INSTR_PERF environment variable is set (and not 0), also starts
+/// hardware performance counters (Linux only): cycles, instructions,
+/// LLC misses and branch misses, for this thread and threads created later.
 void InstrReset(void);
 
+/// Set count[i] to the sum of InstrCount[i] of all registered threads,
+/// including those that already exited, since the last InstrReset.
+/// The counters of other threads are read without synchronization, so
+/// the counts of threads that are still counting may be slightly behind
+/// (they are exact for threads that are not counting meanwhile).
+void InstrSnapshot(unsigned long count[NUMCOUNTERS]);
+
+/// Print times, the totals of all named counters and the hardware counters
+/// that could be started (if any).
 void InstrPrint(void);
 
+/// Timing regions.
+/// InstrBegin(name) ... InstrEnd() delimit a named region of code, and
+/// record its wall time, CPU time and the increments of all counters.
+/// Regions may be nested; a region with the same name as a previous one
+/// with the same parent is aggregated with it (the calls are counted).
+/// Regions are meant to be used by a single thread (counters include the
+/// operations of all threads, as in InstrSnapshot).
+/// The name is not copied: it must remain valid until InstrReport.
+void InstrBegin(const char *name);
+
+/// End the innermost open region.
+void InstrEnd(void);
+
+/// Discard all regions.
+void InstrRegionsClear(void);
+
+/// Report formats
+enum
+{
+  INSTR_JSON, // a tree of regions
+  INSTR_CSV,  // one line per region, with its path (e.g. "save/blur")
+};
+
+/// Write a report of all regions to f, in the given format.
+/// Regions still open are ended first.
+void InstrReport(FILE *f, int format);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,1060 @@
+/// pipeline - Lazy execution of imageTool pipelines.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// See pipeline.h for an overview.
+
+#include "pipeline.h"
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+#include "tiles.h"
+
+// The data structure
+//
+// A pipeline has an array of nodes and an array of actions.
+//
+// Each node is an image value: either a source (a loaded file or a new
+// black image) or the result of an operation applied to the values of its
+// input nodes.  Operations that imageTool applies in-place (neg, blur,
+// paste, ...) produce a new node too, which replaces the old value in
+// the image buffer.  So, nodes never change once defined, and the input
+// nodes of a node always come before it in the array.
+//
+// Actions are the operations that produce output (save, info, locate)
+// or that control instrumentation (tic, toc).  They are executed in
+// command line order, and they are the only reason to compute any node.
+
+// Image buffer capacity (same as in imageTool)
+#define BUFFERSIZE 10
+
+// Maximum number of level transformations fused in a single node
+#define MAXSTEPS 16
+
+typedef enum
+{
+  NODE_LOAD,      // load file
+  NODE_CREATE,    // create black image w x h
+  NODE_LEVELS,    // pixel level transformations (neg, thr, bri)
+  NODE_TRANSFORM, // geometric transformation (rotate, mirror, ...)
+  NODE_CROP,      // crop rectangle (x, y, w, h)
+  NODE_PASTE,     // paste in2 into in at (x, y)
+  NODE_BLEND,     // blend in2 into in at (x, y) with alpha
+  NODE_BLUR,      // blur with dx = w, dy = h
+  NODE_ALIAS,     // same value as node in (left by the optimizer)
+} NodeKind;
+
+// Names of node kinds (for timing regions)
+static const char *nodeNames[] = {
+    "load", "create", "levels", "transform", "crop", "paste", "blend", "blur", "alias",
+};
+
+// A pixel level transformation
+struct step
+{
+  char op;    // 'n' (negative), 't' (threshold) or 'b' (brighten)
+  double arg; // threshold level or brightening factor
+};
+
+struct node
+{
+  NodeKind kind;
+  int in;    // input node (CURR), or -1
+  int in2;   // second input node (PRED), or -1
+  int uses;  // number of uses of the value (see countUses)
+  // Operands:
+  const char *file;
+  int x, y, w, h;
+  double alpha;
+  ImageOrientation orient;
+  int square; // does the transformation require a square image?
+  int nsteps;
+  struct step steps[MAXSTEPS];
+};
+
+typedef enum
+{
+  ACT_SAVE,
+  ACT_INFO,
+  ACT_LOCATE,
+  ACT_ALOCATE,
+  ACT_TIC,
+  ACT_TOC,
+} ActionKind;
+
+// Names of actions (for timing regions)
+static const char *actionNames[] = {"save", "info", "locate", "alocate", "tic", "toc"};
+
+struct action
+{
+  ActionKind kind;
+  int node;  // CURR node
+  int node2;  // PRED node (for locate)
+  int maxerr; // pixels that may differ (for alocate)
+  int slot;   // buffer index of CURR (for messages)
+  const char *file;
+};
+
+struct pipeline
+{
+  int numNodes;
+  struct node *nodes;
+  int numActions;
+  struct action *actions;
+};
+
+// Names of the orientations, for messages.
+static const char *orientNames[] = {
+    "id", "rot90", "rot180", "rot270",
+    "flipx", "flipy", "transpose", "antitranspose",
+};
+
+// Add a new node to p, and return its index.
+static int newNode(Pipeline p, NodeKind kind, int in, int in2)
+{
+  struct node *nd = &p->nodes[p->numNodes];
+  memset(nd, 0, sizeof(*nd));
+  nd->kind = kind;
+  nd->in = in;
+  nd->in2 = in2;
+  return p->numNodes++;
+}
+
+// Add a new action to p, and return a pointer to it.
+static struct action *newAction(Pipeline p, ActionKind kind)
+{
+  struct action *act = &p->actions[p->numActions++];
+  memset(act, 0, sizeof(*act));
+  act->kind = kind;
+  act->node = act->node2 = -1;
+  return act;
+}
+
+static void countUses(Pipeline p);
+
+// Operations that take an operand, append a new image to the buffer or
+// use PRED (as in the operations table of imageTool), for collapsedRun.
+static const struct
+{
+  const char *name;
+  int operands;
+  int creates;
+  int usesPred;
+} opInfo[] = {
+    {"save", 1, 0, 0},       {"thr", 1, 0, 0},        {"bri", 1, 0, 0},
+    {"create", 1, 1, 0},     {"rotate", 0, 1, 0},     {"mirror", 0, 1, 0},
+    {"transform", 1, 1, 0},  {"crop", 1, 1, 0},       {"paste", 1, 0, 1},
+    {"blend", 1, 0, 1},      {"locate", 0, 0, 1},     {"alocate", 1, 0, 1},
+    {"blur", 1, 0, 0},       {"info", 0, 0, 0},       {"tic", 0, 0, 0},
+    {"toc", 0, 0, 0},        {"neg", 0, 0, 0},        {"irotate", 0, 0, 0},
+    {"irotatecw", 0, 0, 0},  {"rotate180", 0, 0, 0},
+};
+#define NUMOPINFO (int)(sizeof(opInfo) / sizeof(opInfo[0]))
+
+// Number of consecutive rotate/mirror operations starting at av[k] that
+// take a single buffer slot.  imageTool collapses such a run into one
+// transformation, but keeps the last step apart if PRED is used before a
+// new image is appended, so PRED is the image it would be otherwise.
+static int collapsedRun(int ac, char *av[], int k)
+{
+  int run = 0;
+  while (k + run < ac && (strcmp(av[k + run], "rotate") == 0 || strcmp(av[k + run], "mirror") == 0))
+    run++;
+  if (run <= 1)
+    return run;
+  for (int j = k + run; j < ac;)
+  {
+    int i = 0;
+    while (i < NUMOPINFO && strcmp(av[j], opInfo[i].name) != 0)
+      i++;
+    if (i == NUMOPINFO || opInfo[i].creates)
+      break; // an image file, or a new image
+    if (opInfo[i].usesPred)
+      return run - 1;
+    j += 1 + opInfo[i].operands;
+  }
+  return run;
+}
+
+// Build a pipeline from the arguments av[0], ..., av[ac-1].
+// For a batch pipeline, the input image is loaded first and the last image
+// is saved at the end, to files given when running.
+static Pipeline parse(int ac, char *av[], int *err, int batch)
+{
+  Pipeline p = malloc(sizeof(struct pipeline));
+  if (p == NULL)
+  {
+    *err = PIPE_IMAGE8BIT;
+    return NULL;
+  }
+  // Each argument defines at most one node or one action
+  // (plus the input node and output action of a batch)
+  p->numNodes = p->numActions = 0;
+  p->nodes = malloc((ac + 2) * sizeof(struct node));
+  p->actions = malloc((ac + 2) * sizeof(struct action));
+  if (p->nodes == NULL || p->actions == NULL)
+  {
+    PipelineDestroy(&p);
+    *err = PIPE_IMAGE8BIT;
+    return NULL;
+  }
+
+  int buf[BUFFERSIZE]; // nodes in the image buffer
+  int n = 0;           // number of images in the buffer
+  int runLeft = 0;     // following rotate/mirror steps in the same slot
+  int x, y, w, h;
+  *err = PIPE_OK;
+  if (batch)
+    buf[n++] = newNode(p, NODE_LOAD, -1, -1); // file given when running
+
+  for (int k = 0; k < ac && *err == PIPE_OK; k++)
+  {
+    const char *op = av[k];
+    if (strcmp(op, "info") == 0 || strcmp(op, "save") == 0)
+    {
+      if (strcmp(op, "save") == 0 && ++k >= ac)
+        *err = PIPE_OPERANDS;
+      else if (n < 1)
+        *err = PIPE_IMAGES;
+      else
+      {
+        struct action *act = newAction(p, op[0] == 's' ? ACT_SAVE : ACT_INFO);
+        act->node = buf[n - 1];
+        act->slot = n - 1;
+        act->file = op[0] == 's' ? av[k] : NULL;
+      }
+    }
+    else if (strcmp(op, "tic") == 0)
+    {
+      newAction(p, ACT_TIC);
+    }
+    else if (strcmp(op, "toc") == 0)
+    {
+      newAction(p, ACT_TOC);
+    }
+    else if (strcmp(op, "neg") == 0 || strcmp(op, "thr") == 0 || strcmp(op, "bri") == 0)
+    {
+      struct step st = {op[0], 0.0};
+      uint8 thr;
+      if (op[0] != 'n' && ++k >= ac)
+        *err = PIPE_OPERANDS;
+      else if (n < 1)
+        *err = PIPE_IMAGES;
+      else if (op[0] == 't' && sscanf(av[k], "%hhu", &thr) != 1)
+        *err = PIPE_OPERAND;
+      else if (op[0] == 'b' && sscanf(av[k], "%lf", &st.arg) != 1)
+        *err = PIPE_OPERAND;
+      else
+      {
+        if (op[0] == 't')
+          st.arg = thr;
+        int i = newNode(p, NODE_LEVELS, buf[n - 1], -1);
+        p->nodes[i].nsteps = 1;
+        p->nodes[i].steps[0] = st;
+        buf[n - 1] = i;
+      }
+    }
+    else if (strcmp(op, "create") == 0)
+    {
+      if (++k >= ac)
+        *err = PIPE_OPERANDS;
+      else if (n >= BUFFERSIZE)
+        *err = PIPE_FULL;
+      else if (sscanf(av[k], "%d,%d", &w, &h) != 2 || w < 0 || h < 0)
+        *err = PIPE_OPERAND;
+      else
+      {
+        int i = newNode(p, NODE_CREATE, -1, -1);
+        p->nodes[i].w = w;
+        p->nodes[i].h = h;
+        buf[n++] = i;
+      }
+    }
+    else if (strcmp(op, "rotate") == 0 || strcmp(op, "mirror") == 0 || strcmp(op, "transform") == 0)
+    {
+      int o = op[0] == 'r' ? ORIENT_ROT90 : ORIENT_FLIPX;
+      if (op[0] != 't' && runLeft > 0)
+      { // next step of a collapsed run: replaces the image of the run
+        int i = newNode(p, NODE_TRANSFORM, buf[n - 1], -1);
+        p->nodes[i].orient = (ImageOrientation)o;
+        buf[n - 1] = i;
+        runLeft--;
+      }
+      else if (op[0] == 't' && ++k >= ac)
+        *err = PIPE_OPERANDS;
+      else if (n < 1)
+        *err = PIPE_IMAGES;
+      else if (n >= BUFFERSIZE)
+        *err = PIPE_FULL;
+      else
+      {
+        if (op[0] == 't')
+        {
+          for (o = 0; o < 8 && strcmp(av[k], orientNames[o]) != 0; o++)
+            ;
+        }
+        if (o == 8)
+          *err = PIPE_OPERAND;
+        else
+        {
+          int i = newNode(p, NODE_TRANSFORM, buf[n - 1], -1);
+          p->nodes[i].orient = (ImageOrientation)o;
+          buf[n++] = i;
+          if (op[0] != 't')
+            runLeft = collapsedRun(ac, av, k) - 1;
+        }
+      }
+    }
+    else if (strcmp(op, "irotate") == 0 || strcmp(op, "irotatecw") == 0 || strcmp(op, "rotate180") == 0)
+    {
+      if (n < 1)
+        *err = PIPE_IMAGES;
+      else
+      {
+        int i = newNode(p, NODE_TRANSFORM, buf[n - 1], -1);
+        p->nodes[i].orient = strcmp(op, "irotate") == 0     ? ORIENT_ROT90
+                             : strcmp(op, "irotatecw") == 0 ? ORIENT_ROT270
+                                                            : ORIENT_ROT180;
+        p->nodes[i].square = p->nodes[i].orient != ORIENT_ROT180;
+        buf[n - 1] = i;
+      }
+    }
+    else if (strcmp(op, "crop") == 0)
+    {
+      if (++k >= ac)
+        *err = PIPE_OPERANDS;
+      else if (n < 1)
+        *err = PIPE_IMAGES;
+      else if (n >= BUFFERSIZE)
+        *err = PIPE_FULL;
+      else if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4)
+        *err = PIPE_OPERAND;
+      else
+      {
+        int i = newNode(p, NODE_CROP, buf[n - 1], -1);
+        p->nodes[i].x = x;
+        p->nodes[i].y = y;
+        p->nodes[i].w = w;
+        p->nodes[i].h = h;
+        buf[n++] = i;
+      }
+    }
+    else if (strcmp(op, "paste") == 0 || strcmp(op, "blend") == 0)
+    {
+      double alpha = 1.0;
+      if (++k >= ac)
+        *err = PIPE_OPERANDS;
+      else if (n < 2)
+        *err = PIPE_IMAGES;
+      else if (op[0] == 'p' && sscanf(av[k], "%d,%d", &x, &y) != 2)
+        *err = PIPE_OPERAND;
+      else if (op[0] == 'b' && sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3)
+        *err = PIPE_OPERAND;
+      else
+      {
+        int i = newNode(p, op[0] == 'p' ? NODE_PASTE : NODE_BLEND, buf[n - 1], buf[n - 2]);
+        p->nodes[i].x = x;
+        p->nodes[i].y = y;
+        p->nodes[i].alpha = alpha;
+        buf[n - 1] = i;
+      }
+    }
+    else if (strcmp(op, "locate") == 0)
+    {
+      if (n < 2)
+        *err = PIPE_IMAGES;
+      else
+      {
+        struct action *act = newAction(p, ACT_LOCATE);
+        act->node = buf[n - 1];
+        act->node2 = buf[n - 2];
+        act->slot = n - 1;
+      }
+    }
+    else if (strcmp(op, "alocate") == 0)
+    {
+      int maxerr;
+      if (++k >= ac)
+        *err = PIPE_OPERANDS;
+      else if (n < 2)
+        *err = PIPE_IMAGES;
+      else if (sscanf(av[k], "%d", &maxerr) != 1 || maxerr < 0)
+        *err = PIPE_OPERAND;
+      else
+      {
+        struct action *act = newAction(p, ACT_ALOCATE);
+        act->node = buf[n - 1];
+        act->node2 = buf[n - 2];
+        act->maxerr = maxerr;
+        act->slot = n - 1;
+      }
+    }
+    else if (strcmp(op, "blur") == 0)
+    {
+      if (++k >= ac)
+        *err = PIPE_OPERANDS;
+      else if (n < 1)
+        *err = PIPE_IMAGES;
+      else if (sscanf(av[k], "%d,%d", &w, &h) != 2)
+        *err = PIPE_OPERAND;
+      else
+      {
+        int i = newNode(p, NODE_BLUR, buf[n - 1], -1);
+        p->nodes[i].w = w;
+        p->nodes[i].h = h;
+        buf[n - 1] = i;
+      }
+    }
+    else
+    { // image file
+      if (n >= BUFFERSIZE)
+        *err = PIPE_FULL;
+      else
+      {
+        int i = newNode(p, NODE_LOAD, -1, -1);
+        p->nodes[i].file = op;
+        buf[n++] = i;
+      }
+    }
+  }
+  if (batch && *err == PIPE_OK)
+  {
+    struct action *act = newAction(p, ACT_SAVE); // file given when running
+    act->node = buf[n - 1];
+    act->slot = n - 1;
+  }
+
+  if (*err != PIPE_OK)
+  {
+    PipelineDestroy(&p);
+    return NULL;
+  }
+  countUses(p);
+  return p;
+}
+
+/// Build a pipeline from the arguments av[0], ..., av[ac-1].
+Pipeline PipelineParse(int ac, char *av[], int *err)
+{ ///
+  assert(ac >= 0);
+  assert(err != NULL);
+  return parse(ac, av, err, 0);
+}
+
+/// Build a batch pipeline from the arguments av[0], ..., av[ac-1].
+Pipeline PipelineParseBatch(int ac, char *av[], int *err)
+{ ///
+  assert(ac >= 0);
+  assert(err != NULL);
+  return parse(ac, av, err, 1);
+}
+
+// Follow aliases from node i to the node that actually has the value.
+static int resolve(Pipeline p, int i)
+{
+  while (i >= 0 && p->nodes[i].kind == NODE_ALIAS)
+    i = p->nodes[i].in;
+  return i;
+}
+
+// Count the uses of each node by the actions and the nodes they need.
+// Nodes that no action needs end up with zero uses and are never computed.
+static void countUses(Pipeline p)
+{
+  for (int i = 0; i < p->numNodes; i++)
+  {
+    p->nodes[i].uses = 0;
+  }
+  for (int a = 0; a < p->numActions; a++)
+  {
+    struct action *act = &p->actions[a];
+    act->node = resolve(p, act->node);
+    act->node2 = resolve(p, act->node2);
+    if (act->node >= 0)
+      p->nodes[act->node].uses++;
+    if (act->node2 >= 0)
+      p->nodes[act->node2].uses++;
+  }
+  // Inputs come before the nodes that use them, so going backwards we know
+  // whether a node is needed before counting its inputs.
+  for (int i = p->numNodes - 1; i >= 0; i--)
+  {
+    struct node *nd = &p->nodes[i];
+    if (nd->kind == NODE_ALIAS || nd->uses == 0)
+      continue;
+    nd->in = resolve(p, nd->in);
+    nd->in2 = resolve(p, nd->in2);
+    if (nd->in >= 0)
+      p->nodes[nd->in].uses++;
+    if (nd->in2 >= 0)
+      p->nodes[nd->in2].uses++;
+  }
+}
+
+/// Optimize a pipeline.
+void PipelineOptimize(Pipeline p)
+{ ///
+  assert(p != NULL);
+  // Rewrite nodes until no rule applies.
+  // Each rule removes a node or moves a level transformation
+  // closer to the end of the pipeline, so this terminates.
+  int changed;
+  do
+  {
+    changed = 0;
+    countUses(p);
+    for (int i = 0; i < p->numNodes; i++)
+    {
+      struct node *nd = &p->nodes[i];
+      if (nd->kind == NODE_ALIAS || nd->uses == 0)
+        continue;
+      // Rewrites below only apply if this node is the single use of its
+      // input, so that the input value itself is no longer needed.
+      struct node *in = nd->in >= 0 ? &p->nodes[nd->in] : NULL;
+      int single = in != NULL && in->uses == 1;
+
+      if (single && nd->kind == NODE_LEVELS && in->kind == NODE_LEVELS &&
+          in->nsteps + nd->nsteps <= MAXSTEPS)
+      { // Fuse level transformations: in's steps come first
+        memmove(nd->steps + in->nsteps, nd->steps, nd->nsteps * sizeof(struct step));
+        memcpy(nd->steps, in->steps, in->nsteps * sizeof(struct step));
+        nd->nsteps += in->nsteps;
+        nd->in = in->in;
+        in->uses = 0;
+        changed = 1;
+      }
+      else if (single && nd->kind == NODE_TRANSFORM && in->kind == NODE_TRANSFORM)
+      { // Compose geometric transformations
+        nd->orient = ImageOrientationCompose(in->orient, nd->orient);
+        nd->square |= in->square;
+        nd->in = in->in;
+        in->uses = 0;
+        changed = 1;
+      }
+      else if (single && (nd->kind == NODE_CROP || nd->kind == NODE_TRANSFORM) &&
+               in->kind == NODE_LEVELS)
+      { // Level transformations commute with crops and geometric ones.
+        // Crop first, so that fewer pixels are transformed, and transform
+        // geometry first, so that it may be composed with previous ones.
+        // The two nodes swap contents, so node i keeps being the final value.
+        struct node geom = *nd;
+        struct node levels = *in;
+        geom.in = levels.in;
+        levels.in = nd->in;
+        *in = geom;
+        *nd = levels;
+        changed = 1;
+      }
+      if (nd->kind == NODE_TRANSFORM && nd->orient == ORIENT_IDENTITY && !nd->square)
+      { // Transformations cancelled out
+        nd->kind = NODE_ALIAS;
+        changed = 1;
+      }
+      if (changed)
+        countUses(p);
+    }
+  } while (changed);
+}
+
+// The state of a pipeline run.
+// The pipeline itself is not modified while running, so several runs of
+// the same pipeline may proceed at the same time (in different threads).
+struct run
+{
+  Pipeline p;
+  int *uses;          // number of pending uses of each node's value
+  Image *img;         // computed value of each node, or NULL
+  const char *input;  // file for NODE_LOAD nodes without a file
+  const char *output; // file for ACT_SAVE actions without a file
+  int verbose;        // print progress messages?
+  int profile;        // record timing regions? (not thread-safe)
+  unsigned long pixels; // pixels loaded
+};
+
+// Print a progress message to stderr, if the run is verbose.
+static void note(struct run *r, const char *format, ...)
+{
+  if (!r->verbose)
+    return;
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+// Release one use of the value of node i.
+// Its image is destroyed when it has no more pending uses.
+static void release(struct run *r, int i)
+{
+  assert(r->uses[i] > 0);
+  if (--r->uses[i] == 0 && r->img[i] != NULL)
+    ImageDestroy(&r->img[i]);
+}
+
+static Image eval(struct run *r, int i, int *err);
+
+// Get an image with the value of node i that may be modified in-place.
+// If this is the last use of the value, its image is taken from the node,
+// otherwise a copy is made.
+// On failure, returns NULL and (*err) is set.
+static Image take(struct run *r, int i, int *err)
+{
+  Image img = eval(r, i, err);
+  if (img == NULL)
+    return NULL;
+  if (r->uses[i] == 1)
+  {
+    r->img[i] = NULL;
+    r->uses[i] = 0;
+    return img;
+  }
+  Image copy = ImageTransform(img, ORIENT_IDENTITY);
+  if (copy == NULL)
+  {
+    *err = PIPE_IMAGE8BIT;
+    return NULL;
+  }
+  release(r, i);
+  return copy;
+}
+
+// Compute the lookup table equivalent to the level transformations of
+// node nd, for images with the given maxval.
+// The steps are applied by the image8bit functions to an image with all
+// 256 levels, so mapping an image through the table gives exactly the same
+// result as applying the steps one by one.
+// Returns 0 on failure.
+static int levelTable(struct node *nd, int maxval, uint8 table[256])
+{
+  Image ramp = ImageCreate(256, 1, (uint8)maxval);
+  if (ramp == NULL)
+    return 0;
+  uint8 levels[256];
+  for (int v = 0; v < 256; v++)
+  {
+    levels[v] = (uint8)v;
+  }
+  ImageSetRow(ramp, 0, 0, 256, levels);
+  for (int s = 0; s < nd->nsteps; s++)
+  {
+    switch (nd->steps[s].op)
+    {
+    case 'n':
+      ImageNegative(ramp);
+      break;
+    case 't':
+      ImageThreshold(ramp, (uint8)nd->steps[s].arg);
+      break;
+    case 'b':
+      ImageBrighten(ramp, nd->steps[s].arg);
+      break;
+    }
+  }
+  ImageGetRow(ramp, 0, 0, 256, table);
+  ImageDestroy(&ramp);
+  return 1;
+}
+
+// Maximum number of nodes run together in strips
+#define MAXCHAIN 16
+
+// Check if the blur filter of node nd fits inside img (ImageBlur requires it).
+static int blurFits(Image img, const struct node *nd)
+{
+  return 2 * nd->w + 1 <= ImageWidth(img) && 2 * nd->h + 1 <= ImageHeight(img);
+}
+
+// Can node i be run as a stage of the strip executor?
+static int isStage(Pipeline p, int i)
+{
+  NodeKind kind = p->nodes[i].kind;
+  return kind == NODE_LEVELS || kind == NODE_BLUR || kind == NODE_PASTE || kind == NODE_BLEND;
+}
+
+// Compute node i and the chain of stages before it, one strip at a time.
+// The chain goes back from node i while each input is a stage that is
+// not used anywhere else, so its value is never needed as a whole image.
+// Returns NULL if there is no chain worth running in strips (fewer than
+// 2 stages), or on failure, in which case (*err) is set.
+static Image evalChain(struct run *r, int i, int *err)
+{
+  Pipeline p = r->p;
+  int chain[MAXCHAIN]; // nodes, from last to first
+  int len = 1;
+  chain[0] = i;
+  while (len < MAXCHAIN)
+  {
+    int in = p->nodes[chain[len - 1]].in;
+    if (!isStage(p, in) || r->uses[in] != 1 || r->img[in] != NULL)
+      break;
+    chain[len++] = in;
+  }
+  if (len < 2)
+    return NULL;
+
+  int base = p->nodes[chain[len - 1]].in;
+  Image src = eval(r, base, err);
+  if (src == NULL)
+    return NULL;
+  uint8 tables[MAXCHAIN][256];
+  TileStage stages[MAXCHAIN];
+  for (int s = 0; s < len; s++)
+  {
+    struct node *nd = &p->nodes[chain[len - 1 - s]];
+    TileStage *st = &stages[s];
+    switch (nd->kind)
+    {
+    case NODE_LEVELS:
+      st->kind = STAGE_LEVELS;
+      st->table = tables[s];
+      if (!levelTable(nd, ImageMaxval(src), tables[s]))
+      {
+        *err = PIPE_IMAGE8BIT;
+        return NULL;
+      }
+      break;
+    case NODE_BLUR:
+      st->kind = STAGE_BLUR;
+      st->dx = nd->w;
+      st->dy = nd->h;
+      if (!blurFits(src, nd))
+      {
+        *err = PIPE_OPERAND;
+        return NULL;
+      }
+      break;
+    default: // NODE_PASTE, NODE_BLEND
+      st->kind = nd->kind == NODE_PASTE ? STAGE_PASTE : STAGE_BLEND;
+      if ((st->img2 = eval(r, nd->in2, err)) == NULL)
+        return NULL;
+      // These stages do not change the image size
+      if (!ImageValidRect(src, nd->x, nd->y, ImageWidth(st->img2), ImageHeight(st->img2)))
+      {
+        *err = PIPE_RECT;
+        return NULL;
+      }
+      st->x = nd->x;
+      st->y = nd->y;
+      st->alpha = nd->alpha;
+      break;
+    }
+  }
+
+  note(r, "Running %d operations on N%d in strips -> N%d\n", len, base, i);
+  Image img = TileRun(src, stages, len);
+  if (img == NULL)
+  {
+    *err = PIPE_IMAGE8BIT;
+    return NULL;
+  }
+  release(r, base);
+  for (int s = 0; s < len; s++)
+  {
+    struct node *nd = &p->nodes[chain[s]];
+    if (nd->kind == NODE_PASTE || nd->kind == NODE_BLEND)
+      release(r, nd->in2);
+    if (s > 0)
+      r->uses[chain[s]] = 0; // consumed by the chain
+  }
+  return img;
+}
+
+// Compute the value of node i.
+// On failure, returns NULL and (*err) is set.
+static Image compute(struct run *r, int i, int *err)
+{
+  Pipeline p = r->p;
+  struct node *nd = &p->nodes[i];
+  Image img = NULL;
+  Image src, pred;
+  if (isStage(p, i))
+  { // Try running it with the stages before it
+    int err0 = *err;
+    if ((img = evalChain(r, i, err)) != NULL)
+    {
+      r->img[i] = img;
+      return img;
+    }
+    if (*err != err0)
+      return NULL;
+  }
+  switch (nd->kind)
+  {
+  case NODE_LOAD:
+  {
+    const char *file = nd->file != NULL ? nd->file : r->input;
+    note(r, "Loading %s -> N%d\n", file, i);
+    img = ImageLoad(file);
+    if (img != NULL)
+      r->pixels += (unsigned long)ImageWidth(img) * ImageHeight(img);
+    break;
+  }
+  case NODE_CREATE:
+    note(r, "Creating black image (%d,%d) -> N%d\n", nd->w, nd->h, i);
+    img = ImageCreate(nd->w, nd->h, PixMax);
+    break;
+  case NODE_LEVELS:
+    if ((img = take(r, nd->in, err)) == NULL)
+      return NULL;
+    note(r, "Transforming levels of N%d (%d steps) -> N%d\n", nd->in, nd->nsteps, i);
+    uint8 table[256];
+    if (levelTable(nd, ImageMaxval(img), table))
+      ImageMapLevels(img, table);
+    else
+      ImageDestroy(&img);
+    break;
+  case NODE_TRANSFORM:
+    if ((src = eval(r, nd->in, err)) == NULL)
+      return NULL;
+    if (nd->square && ImageWidth(src) != ImageHeight(src))
+    {
+      *err = PIPE_SQUARE;
+      return NULL;
+    }
+    if (nd->orient == ORIENT_IDENTITY)
+    { // only left for the square check
+      if ((img = take(r, nd->in, err)) == NULL)
+        return NULL;
+      break;
+    }
+    note(r, "Transforming N%d (%s) -> N%d\n", nd->in, orientNames[nd->orient], i);
+    img = ImageTransform(src, nd->orient);
+    release(r, nd->in);
+    break;
+  case NODE_CROP:
+    if ((src = eval(r, nd->in, err)) == NULL)
+      return NULL;
+    if (!ImageValidRect(src, nd->x, nd->y, nd->w, nd->h))
+    {
+      *err = PIPE_OPERAND;
+      return NULL;
+    }
+    note(r, "Cropping N%d (%d,%d,%d,%d) -> N%d\n", nd->in, nd->x, nd->y, nd->w, nd->h, i);
+    img = ImageCrop(src, nd->x, nd->y, nd->w, nd->h);
+    release(r, nd->in);
+    break;
+  case NODE_PASTE:
+  case NODE_BLEND:
+    if ((pred = eval(r, nd->in2, err)) == NULL || (src = eval(r, nd->in, err)) == NULL)
+      return NULL;
+    if (!ImageValidRect(src, nd->x, nd->y, ImageWidth(pred), ImageHeight(pred)))
+    {
+      *err = PIPE_RECT;
+      return NULL;
+    }
+    if ((img = take(r, nd->in, err)) == NULL)
+      return NULL;
+    note(r, "%s N%d at N%d (%d,%d) -> N%d\n", nd->kind == NODE_PASTE ? "Pasting" : "Blending",
+            nd->in2, nd->in, nd->x, nd->y, i);
+    if (nd->kind == NODE_PASTE)
+      ImagePaste(img, nd->x, nd->y, pred);
+    else
+      ImageBlend(img, nd->x, nd->y, pred, nd->alpha);
+    release(r, nd->in2);
+    break;
+  case NODE_BLUR:
+    if ((src = eval(r, nd->in, err)) == NULL)
+      return NULL;
+    if (!blurFits(src, nd))
+    {
+      *err = PIPE_OPERAND;
+      return NULL;
+    }
+    if ((img = take(r, nd->in, err)) == NULL)
+      return NULL;
+    note(r, "Blur N%d with %dx%d mean filter -> N%d\n", nd->in, 2 * nd->w + 1, 2 * nd->h + 1, i);
+    ImageBlur(img, nd->w, nd->h);
+    break;
+  case NODE_ALIAS:
+    assert(0); // aliases are resolved by countUses
+    break;
+  }
+  if (img == NULL)
+  {
+    *err = PIPE_IMAGE8BIT;
+    return NULL;
+  }
+  r->img[i] = img;
+  return img;
+}
+
+// Get the value of node i, computing it if necessary.
+// In profiled runs, each computation is a timing region, which includes
+// the computation of the inputs it needs.
+// On failure, returns NULL and (*err) is set.
+static Image eval(struct run *r, int i, int *err)
+{
+  if (r->img[i] != NULL)
+    return r->img[i];
+  if (r->profile)
+    InstrBegin(nodeNames[r->p->nodes[i].kind]);
+  Image img = compute(r, i, err);
+  if (r->profile)
+    InstrEnd();
+  return img;
+}
+
+// Does file name end in .pbm?
+static int isPbm(const char *file)
+{
+  size_t len = strlen(file);
+  return len >= 4 && strcmp(file + len - 4, ".pbm") == 0;
+}
+
+// Convert img to a bitmap: pixels of at least half maxval are set.
+// Returns NULL on failure.
+static Bitmap binarize(Image img)
+{
+  return ImageThresholdToBitmap(img, (uint8)((ImageMaxval(img) + 1) / 2));
+}
+
+// Save img to PBM file, binarized.
+// Returns 0 on failure.
+static int saveBitmap(Image img, const char *file)
+{
+  Bitmap bmp = binarize(img);
+  int success = bmp != NULL && BitmapSave(bmp, file);
+  BitmapDestroy(&bmp);
+  return success;
+}
+
+// Run pipeline p with the given input and output files.
+static int run(Pipeline p, const char *input, const char *output, int verbose, int profile,
+               unsigned long *pixels)
+{
+  int err = PIPE_OK;
+  struct run state = {p, NULL, NULL, input, output, verbose, profile, 0};
+  struct run *r = &state;
+  r->uses = malloc(p->numNodes * sizeof(int) + 1);
+  r->img = calloc(p->numNodes + 1, sizeof(Image));
+  if (r->uses == NULL || r->img == NULL)
+    err = PIPE_IMAGE8BIT;
+  else
+  {
+    for (int i = 0; i < p->numNodes; i++)
+      r->uses[i] = p->nodes[i].uses;
+  }
+
+  for (int a = 0; a < p->numActions && err == PIPE_OK; a++)
+  {
+    struct action *act = &p->actions[a];
+    Image img, img2;
+    int x, y;
+    if (r->profile)
+      InstrBegin(actionNames[act->kind]);
+    switch (act->kind)
+    {
+    case ACT_TIC:
+      InstrReset();
+      break;
+    case ACT_TOC:
+      InstrPrint();
+      break;
+    case ACT_SAVE:
+    {
+      if ((img = eval(r, act->node, &err)) == NULL)
+        break;
+      const char *file = act->file != NULL ? act->file : output;
+      note(r, "Saving %s <- I%d\n", file, act->slot);
+      if (!(isPbm(file) ? saveBitmap(img, file) : ImageSave(img, file)))
+        err = PIPE_IMAGE8BIT;
+      release(r, act->node);
+      break;
+    }
+    case ACT_INFO:
+      if ((img = eval(r, act->node, &err)) == NULL)
+        break;
+      note(r, "Info on I%d\n", act->slot);
+      uint8 min, max;
+      ImageStats(img, &min, &max);
+      printf("# Size: %dx%d\n# Maxval: %hhu\n", ImageWidth(img), ImageHeight(img), (uint8)ImageMaxval(img));
+      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      release(r, act->node);
+      break;
+    case ACT_LOCATE:
+      if ((img2 = eval(r, act->node2, &err)) == NULL || (img = eval(r, act->node, &err)) == NULL)
+        break;
+      note(r, "Locating I%d in I%d\n", act->slot - 1, act->slot);
+      if (ImageLocateSubImage(img, &x, &y, img2))
+        printf("# FOUND (%d,%d)\n", x, y);
+      else
+        printf("# NOTFOUND\n");
+      release(r, act->node);
+      release(r, act->node2);
+      break;
+    case ACT_ALOCATE:
+    {
+      if ((img2 = eval(r, act->node2, &err)) == NULL || (img = eval(r, act->node, &err)) == NULL)
+        break;
+      note(r, "Locating I%d in I%d, with up to %d different pixels\n", act->slot - 1, act->slot,
+           act->maxerr);
+      Bitmap bmp = binarize(img);
+      Bitmap bmp2 = binarize(img2);
+      if (bmp == NULL || bmp2 == NULL)
+        err = PIPE_IMAGE8BIT;
+      else if (BitmapLocateApprox(bmp, &x, &y, bmp2, act->maxerr))
+        printf("# FOUND (%d,%d) with %d different pixels\n", x, y,
+               BitmapMismatches(bmp, x, y, bmp2, act->maxerr));
+      else
+        printf("# NOTFOUND\n");
+      BitmapDestroy(&bmp);
+      BitmapDestroy(&bmp2);
+      release(r, act->node);
+      release(r, act->node2);
+      break;
+    }
+    }
+    if (r->profile)
+      InstrEnd();
+  }
+
+  // Cleanup (after a failure, some images may remain)
+  if (r->img != NULL)
+  {
+    for (int i = 0; i < p->numNodes; i++)
+    {
+      if (r->img[i] != NULL)
+        ImageDestroy(&r->img[i]);
+    }
+  }
+  free(r->uses);
+  free(r->img);
+  if (pixels != NULL)
+    *pixels += r->pixels;
+  return err;
+}
+
+/// Run a pipeline.
+int PipelineRun(Pipeline p, int profile)
+{ ///
+  assert(p != NULL);
+  return run(p, NULL, NULL, 1, profile, NULL);
+}
+
+/// Run a batch pipeline on one input file.
+int PipelineRunOn(Pipeline p, const char *input, const char *output, unsigned long *pixels)
+{ ///
+  assert(p != NULL);
+  assert(input != NULL);
+  assert(output != NULL);
+  return run(p, input, output, 0, 0, pixels);
+}
+
+/// Destroy the pipeline pointed to by (*pp).
+void PipelineDestroy(Pipeline *pp)
+{ ///
+  assert(pp != NULL);
+  Pipeline p = *pp;
+  if (p == NULL)
+    return;
+  free(p->nodes);
+  free(p->actions);
+  free(p);
+  *pp = NULL;
+}
@@ -0,0 +1,91 @@
+/// pipeline - Lazy execution of imageTool pipelines.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// A pipeline is the sequence of FILES and OPERATIONS given to imageTool
+/// (see the imageTool usage message).  Instead of executing each operation
+/// as soon as it is parsed, the whole command line is first turned into a
+/// small graph of image values, where each node is an operation applied
+/// to the values it depends on.  The graph is then optimized, and only
+/// the values needed by the output operations (save, info, locate) are
+/// computed, in the order those operations appear.
+///
+/// The results are the same as the eager execution in imageTool.
+///
+/// Use as follows:
+///
+/// int err;
+/// Pipeline p = PipelineParse(ac, av, &err);
+/// if (p != NULL) {
+///   PipelineOptimize(p);
+///   err = PipelineRun(p, 0);
+///   PipelineDestroy(&p);
+/// }
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+// Type Pipeline is a pointer to pipeline objects
+typedef struct pipeline *Pipeline;
+
+/// Error codes.
+/// These are the same codes (and messages) used by imageTool.
+enum
+{
+  PIPE_OK,        // Success
+  PIPE_OPERANDS,  // Insufficient operands
+  PIPE_IMAGES,    // Insufficient images
+  PIPE_FULL,      // Image buffer is full
+  PIPE_IMAGE8BIT, // Image8bit failure (see ImageErrMsg())
+  PIPE_OPERAND,   // Invalid operand
+  PIPE_RECT,      // Invalid rect (overflow)
+  PIPE_ALPHA,     // Invalid alpha
+  PIPE_SQUARE,    // Image is not square
+};
+
+/// Build a pipeline from the arguments av[0], ..., av[ac-1].
+/// Only the syntax and the use of the image buffer are checked here.
+/// Checks that depend on image sizes are done by PipelineRun.
+///
+/// On success, a new pipeline is returned.
+/// (The caller is responsible for destroying the returned pipeline!)
+/// On failure, returns NULL and (*err) is set to the error code.
+Pipeline PipelineParse(int ac, char *av[], int *err);
+
+/// Build a batch pipeline from the arguments av[0], ..., av[ac-1].
+/// A batch pipeline is meant to be applied to many input files:
+/// it starts with the input image already in the buffer (as I0),
+/// and the last image in the buffer is saved at the end.
+/// The files are given to PipelineRunOn.
+/// Errors are reported as in PipelineParse.
+Pipeline PipelineParseBatch(int ac, char *av[], int *err);
+
+/// Optimize a pipeline.
+/// Consecutive pixel level transformations are fused into one,
+/// consecutive geometric transformations are composed into one
+/// (and removed if they cancel out), and crops are moved before level
+/// transformations, so that fewer pixels are processed.
+void PipelineOptimize(Pipeline p);
+
+/// Run a pipeline.
+/// Executes the output operations in order, computing the images they need.
+/// If profile, each output operation, and each image computed, is timed as
+/// an instrumentation region (see InstrBegin).
+/// Returns PIPE_OK on success, or the error code of the first failure.
+int PipelineRun(Pipeline p, int profile);
+
+/// Run a batch pipeline with the given input and output files.
+/// Unlike PipelineRun, no progress messages are printed.
+/// The pipeline is not modified, so the same pipeline may be run
+/// by several threads at the same time.
+/// If pixels!=NULL, the number of pixels loaded is added to (*pixels).
+/// Returns PIPE_OK on success, or the error code of the first failure.
+int PipelineRunOn(Pipeline p, const char *input, const char *output, unsigned long *pixels);
+
+/// Destroy the pipeline pointed to by (*pp).
+/// If (*pp)==NULL, no operation is performed.
+/// Ensures: (*pp)==NULL.
+void PipelineDestroy(Pipeline *pp);
+
+#endif
@@ -0,0 +1,84 @@
+// synth - Generate reproducible synthetic PGM images.
+//
+// Writes a synthetic image (see ImageSynthetic in image8bit.h) to a PGM
+// file, one row at a time, so it works for images larger than memory.
+// Optionally, a template is embedded in the image at a known position and
+// also saved to its own file, for testing and benchmarking locate.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: synth [--model MODEL] [--seed N] [--template W,H,X,Y TFILE] W,H FILE\n"
+    "  Write a WxH synthetic image to PGM file FILE.\n"
+    "  The same arguments always produce the same file.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  --model MODEL    Content model (default: noise):\n"
+    "                     noise      uniformly random levels\n"
+    "                     gradient   smooth diagonal gradient, with a little noise\n"
+    "                     blocks     16x16 blocks of 4 levels (low entropy)\n"
+    "                     nearmatch  black, nearly matching the template everywhere\n"
+    "                                (worst case for locate)\n"
+    "  --seed N         Seed of the pseudo-random generator (default: 1)\n"
+    "  --template W,H,X,Y TFILE\n"
+    "                   Embed a WxH template at (X,Y) and save it to TFILE\n"
+    "\n";
+
+static const char* modelNames[] = {"noise", "gradient", "blocks", "nearmatch"};
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+
+  int model = SYNTH_NOISE;
+  unsigned long seed = 1;
+  int tw = 0, th = 0, tx = 0, ty = 0;
+  const char* tfile = NULL;
+  int k = 1;
+  while (k < argc && strncmp(argv[k], "--", 2) == 0) {
+    if (strcmp(argv[k], "--model") == 0 && k + 1 < argc) {
+      model = 0;
+      while (model < 4 && strcmp(argv[k + 1], modelNames[model]) != 0) model++;
+      if (model == 4) error(1, 0, "Invalid model %s\n%s", argv[k + 1], USAGE);
+      k += 2;
+    } else if (strcmp(argv[k], "--seed") == 0 && k + 1 < argc) {
+      if (sscanf(argv[k + 1], "%lu", &seed) != 1) error(1, 0, "Invalid seed\n%s", USAGE);
+      k += 2;
+    } else if (strcmp(argv[k], "--template") == 0 && k + 2 < argc) {
+      if (sscanf(argv[k + 1], "%d,%d,%d,%d", &tw, &th, &tx, &ty) != 4 || tw <= 0 || th <= 0)
+        error(1, 0, "Invalid template\n%s", USAGE);
+      tfile = argv[k + 2];
+      k += 3;
+    } else {
+      error(1, 0, "Invalid option %s\n%s", argv[k], USAGE);
+    }
+  }
+  int w, h;
+  if (argc - k != 2 || sscanf(argv[k], "%d,%d", &w, &h) != 2 || w < 0 || h < 0)
+    error(1, 0, "\n%s", USAGE);
+  const char* file = argv[k + 1];
+
+  Image tmpl = NULL;
+  if (tfile != NULL) {
+    if (tx < 0 || ty < 0 || tx + tw > w || ty + th > h)
+      error(1, 0, "Template does not fit in the image");
+    // A different seed, so that the template is not part of the background
+    tmpl = ImageSyntheticTemplate(tw, th, model, seed + 1);
+    if (tmpl == NULL || ImageSave(tmpl, tfile) == 0)
+      error(2, errno, "%s: %s", tfile, ImageErrMsg());
+  }
+  if (ImageSaveSynthetic(file, w, h, model, seed, tmpl, tx, ty) == 0)
+    error(2, errno, "%s: %s", file, ImageErrMsg());
+  ImageDestroy(&tmpl);
+  return 0;
+}
@@ -0,0 +1,104 @@
+/// tiles - Strip-based execution of chains of image operations.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// See tiles.h for an overview.
+
+#include "tiles.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+// Apply stage st to strip, which holds rows [top, top + strip height)
+// of the whole image.
+// Returns 0 on failure.
+static int runStage(const TileStage *st, Image strip, int top)
+{
+  switch (st->kind)
+  {
+  case STAGE_LEVELS:
+    ImageMapLevels(strip, st->table);
+    break;
+  case STAGE_BLUR:
+    ImageBlur(strip, st->dx, st->dy);
+    break;
+  case STAGE_PASTE:
+  case STAGE_BLEND:
+  { // Only the rows of img2 that overlap the strip are used
+    int h = ImageHeight(strip);
+    int r0 = st->y > top ? st->y : top;
+    int r1 = st->y + ImageHeight(st->img2) < top + h ? st->y + ImageHeight(st->img2) : top + h;
+    if (r0 >= r1)
+      break;
+    Image part = ImageCrop(st->img2, 0, r0 - st->y, ImageWidth(st->img2), r1 - r0);
+    if (part == NULL)
+      return 0;
+    if (st->kind == STAGE_PASTE)
+      ImagePaste(strip, st->x, r0 - top, part);
+    else
+      ImageBlend(strip, st->x, r0 - top, part, st->alpha);
+    ImageDestroy(&part);
+    break;
+  }
+  }
+  return 1;
+}
+
+/// Apply a chain of n operations to img, one strip at a time.
+Image TileRun(Image img, const TileStage *stages, int n)
+{ ///
+  assert(img != NULL);
+  assert(stages != NULL || n == 0);
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+
+  // The halo must cover the neighborhoods of all blurs in the chain
+  int halo = 0;
+  for (int s = 0; s < n; s++)
+  {
+    if (stages[s].kind == STAGE_BLUR)
+      halo += stages[s].dy;
+  }
+  // Rows per strip: about TILEBYTES pixels, but not much less than the
+  // halo, or most of the work would be discarded.
+  int rows = TILEBYTES / (w > 0 ? w : 1);
+  if (rows < 4 * halo)
+    rows = 4 * halo;
+  if (rows < 1)
+    rows = 1;
+
+  // Every row of the result is written by a strip, so it is not cleared
+  Image result = ImageCreateUninitCtx(ImageGetContext(img), w, h, (uint8)ImageMaxval(img));
+  if (result == NULL)
+    return NULL;
+
+  int y1;
+  for (int y0 = 0; y0 < h; y0 = y1)
+  {
+    y1 = y0 + rows < h ? y0 + rows : h; // strip rows [y0, y1)
+    if (h - y1 < rows / 2)
+      y1 = h; // no short strip at the end (ImageBlur needs enough rows)
+    int s0 = y0 - halo > 0 ? y0 - halo : 0; // with halo [s0, s1)
+    int s1 = y1 + halo < h ? y1 + halo : h;
+    Image strip = ImageCrop(img, 0, s0, w, s1 - s0);
+    Image core = NULL;
+    int success = strip != NULL;
+    for (int s = 0; s < n && success; s++)
+    {
+      success = runStage(&stages[s], strip, s0);
+    }
+    if (success)
+      core = ImageCrop(strip, 0, y0 - s0, w, y1 - y0);
+    if (core == NULL)
+    {
+      ImageDestroy(&strip);
+      ImageDestroy(&result);
+      return NULL;
+    }
+    ImagePaste(result, 0, y0, core);
+    ImageDestroy(&core);
+    ImageDestroy(&strip);
+  }
+  return result;
+}
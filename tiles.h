@@ -0,0 +1,59 @@
+/// tiles - Strip-based execution of chains of image operations.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// Applying a chain of operations to a large image, one operation at a
+/// time, makes each operation read and write the whole image, and for
+/// images much larger than the cache every pass goes to main memory.
+///
+/// This module runs the whole chain on one horizontal strip of the image
+/// at a time, using the usual image8bit functions on each strip.  Strips
+/// are small enough to stay in cache (about TILEBYTES pixels), so the image
+/// is read from memory only once and written only once.
+///
+/// Operations that need neighbor pixels (blur) get extra rows above and
+/// below the strip (a halo), enough for all such operations in the chain.
+/// Those rows are computed and then discarded, so the result is exactly
+/// the same as applying the operations to the whole image.
+
+#ifndef TILES_H
+#define TILES_H
+
+#include "image8bit.h"
+
+/// Approximate number of pixels in a strip (about the size of L2 cache)
+#define TILEBYTES (256 * 1024)
+
+/// Kinds of operations that may be chained
+typedef enum
+{
+  STAGE_LEVELS, // ImageMapLevels(img, table)
+  STAGE_BLUR,   // ImageBlur(img, dx, dy)
+  STAGE_PASTE,  // ImagePaste(img, x, y, img2)
+  STAGE_BLEND,  // ImageBlend(img, x, y, img2, alpha)
+} StageKind;
+
+/// An operation in a chain
+typedef struct
+{
+  StageKind kind;
+  const uint8 *table; // for STAGE_LEVELS: 256 entries
+  int dx, dy;         // for STAGE_BLUR
+  Image img2;         // for STAGE_PASTE and STAGE_BLEND
+  int x, y;           // for STAGE_PASTE and STAGE_BLEND
+  double alpha;       // for STAGE_BLEND
+} TileStage;
+
+/// Apply a chain of n operations to img, one strip at a time.
+/// Returns the result as a new image, with the same size and maxval.
+/// Requires: each operation's preconditions hold for the whole image
+///   (e.g., img2 must fit inside img at (x, y)).
+/// Ensures: img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/ImageErrMsg() are set accordingly.
+Image TileRun(Image img, const TileStage *stages, int n);
+
+#endif